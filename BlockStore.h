@@ -0,0 +1,196 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include "Rope.h"
+
+using namespace std;
+
+
+// 64-bit hash of a byte range, 8 bytes per step. Two seeds give two independent halves of a 128-bit
+// content key, which is what blocks are addressed by.
+inline uint64_t hashBytes(const char* data, size_t len, uint64_t seed) {
+    auto mix = [](uint64_t z) {
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    };
+    uint64_t h = mix(seed ^ (len * 0x9E3779B97F4A7C15ull));
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        h = mix(h ^ w) * 0x9E3779B97F4A7C15ull;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, len - i);
+    return mix(h ^ tail ^ (uint64_t(len - i) << 56));
+}
+
+struct BlockKey {
+    uint64_t lo, hi;
+    bool operator==(const BlockKey& o) const { return lo == o.lo && hi == o.hi; }
+};
+struct BlockKeyHash {
+    size_t operator()(const BlockKey& k) const { return k.lo; }
+};
+
+inline BlockKey blockKey(string_view data) {
+    return {hashBytes(data.data(), data.size(), 0x243F6A8885A308D3ull), hashBytes(data.data(), data.size(), 0x13198A2E03707344ull)};
+}
+
+
+// Content-defined chunking with a gear rolling hash (as in FastCDC): a boundary falls wherever the
+// hash of the last few dozen bytes has its top MASK_BITS bits clear, so an insertion only moves the
+// boundaries next to it and identical regions of different files cut into identical chunks.
+class Chunker {
+    public:
+        static constexpr size_t MIN_SIZE = 2 << 10; // No boundary before this many bytes
+        static constexpr size_t MAX_SIZE = 64 << 10; // Forced boundary
+        static constexpr int MASK_BITS = 13; // Average chunk of about MIN_SIZE + 8 KB
+
+    private:
+        uint64_t hash = 0;
+        size_t length = 0; // Bytes in the chunk so far
+
+        static const uint64_t* gear() {
+            static const auto table = [] {
+                struct { uint64_t v[256]; } t;
+                uint64_t x = 0x6A09E667F3BCC908ull;
+                for (uint64_t& g : t.v) { // splitmix64 sequence: fixed, so boundaries never change between builds
+                    x += 0x9E3779B97F4A7C15ull;
+                    uint64_t z = x;
+                    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+                    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+                    g = z ^ (z >> 31);
+                }
+                return t;
+            }();
+            return table.v;
+        }
+
+    public:
+        // Length of the first chunk of data, continuing the chunk fed so far; 0 if data ends inside it.
+        // Call reset() after every boundary.
+        size_t next(string_view data) {
+            const uint64_t* g = gear();
+            const uint64_t mask = ~uint64_t(0) << (64 - MASK_BITS);
+            for (size_t i = 0; i < data.size(); i++) {
+                hash = (hash << 1) + g[uint8_t(data[i])];
+                length++;
+                if ((length >= MIN_SIZE && (hash & mask) == 0) || length >= MAX_SIZE) return i + 1;
+            }
+            return 0;
+        }
+
+        void reset() {
+            hash = 0;
+            length = 0;
+        }
+
+        // Feed the next bytes of a stream, calling chunk(string_view) for every chunk they complete.
+        // Chunks that start in an earlier call are reassembled in `pending`; the rest are not copied.
+        template <typename Chunk>
+        void feed(string_view piece, string& pending, Chunk& chunk) {
+            while (!piece.empty()) {
+                size_t cut = next(piece);
+                if (cut == 0) {
+                    pending.append(piece);
+                    return;
+                }
+                if (pending.empty()) {
+                    chunk(piece.substr(0, cut));
+                } else {
+                    pending.append(piece.substr(0, cut));
+                    chunk(string_view(pending));
+                    pending.clear();
+                }
+                reset();
+                piece.remove_prefix(cut);
+            }
+        }
+
+        // Call chunk(string_view) for each chunk of the content, which may span any number of pieces.
+        // Content is anything with forEachPiece(visit): a Rope::View, or Snapshot's view of a stored file.
+        template <typename Content, typename Chunk>
+        static void split(const Content& content, Chunk chunk) {
+            Chunker c;
+            string pending;
+            content.forEachPiece([&](string_view piece) { c.feed(piece, pending, chunk); });
+            if (!pending.empty()) chunk(string_view(pending));
+        }
+        template <typename Chunk>
+        static void split(string_view content, Chunk chunk) {
+            Chunker c;
+            string pending;
+            c.feed(content, pending, chunk);
+            if (!pending.empty()) chunk(string_view(pending));
+        }
+};
+
+
+// Process-wide store of immutable content blocks addressed by a 128-bit hash of their bytes. Ropes
+// built through it point at the same buffer for every copy of a chunk, in any file. The store only
+// holds weak references: a block goes away with the last piece that uses it. Parallel loads intern
+// from several threads: hashing and copying happen outside the lock, only the map lookups inside it.
+class BlockStore {
+    private:
+        unordered_map<BlockKey, weak_ptr<const string>, BlockKeyHash> blocks;
+        size_t insertsSinceSweep = 0;
+        mutable mutex lock;
+
+        // Forget blocks nobody uses any more, once the map could be half dead
+        void sweep() {
+            for (auto it = blocks.begin(); it != blocks.end();) {
+                if (it->second.expired()) it = blocks.erase(it);
+                else ++it;
+            }
+            insertsSinceSweep = 0;
+        }
+
+    public:
+        static BlockStore& instance() {
+            static BlockStore store;
+            return store;
+        }
+
+        // The shared block holding exactly these bytes, created if no live block does
+        shared_ptr<const string> intern(string_view data) {
+            BlockKey key = blockKey(data);
+            {
+                lock_guard<mutex> guard(lock);
+                auto it = blocks.find(key);
+                if (it != blocks.end()) {
+                    shared_ptr<const string> block = it->second.lock();
+                    if (block && *block == data) return block;
+                }
+            }
+            // Allocated apart from its control block, so the bytes are freed as soon as the last user is gone
+            shared_ptr<const string> block(new const string(data));
+            lock_guard<mutex> guard(lock);
+            weak_ptr<const string>& slot = blocks[key];
+            shared_ptr<const string> raced = slot.lock(); // Another thread may have added it meanwhile
+            if (raced && *raced == data) return raced;
+            slot = block;
+            if (++insertsSinceSweep > blocks.size() / 2 + 1024) sweep();
+            return block;
+        }
+
+        // Content as a rope of deduplicated blocks
+        template <typename Content> // Rope::View or string_view
+        Rope build(const Content& content) {
+            Rope out;
+            Chunker::split(content, [&](string_view chunk) { out.appendShared(intern(chunk)); });
+            return out;
+        }
+
+        // Blocks in the map, a few of which may already be dead until the next sweep
+        size_t size() const {
+            lock_guard<mutex> guard(lock);
+            return blocks.size();
+        }
+};
@@ -1,86 +1,321 @@
 #pragma once
 #include <iostream>
+#include <iomanip>
+#include <array>
+#include <sstream>
+#include <string_view>
+#include <type_traits>
 #include <vector>
-#include <algorithm>
+#include "FileSystem.h"
+#include "FuzzyMatch.h"
 using namespace std;
 
 
-// Function to calculate Levenshtein distance
-int levenshtein(const string &s1, const string &s2) {
-    int len1 = s1.length(), len2 = s2.length();
-    vector<vector<int>> dist(len1 + 1, vector<int>(len2 + 1));
+// ---------------------------------------------------------------------------------------------
+// Command registry: every command is described once here. Dispatch, help, the menu and the
+// suggestion list are all generated from this table.
+// ---------------------------------------------------------------------------------------------
 
-    for (int i = 0; i <= len1; i++) dist[i][0] = i;
-    for (int j = 0; j <= len2; j++) dist[0][j] = j;
+// Kinds of arguments a command takes, in the order they appear on the line
+enum class ArgKind { WORD, INT, OPTIONAL_INT, TEXT, OPTIONAL_TEXT, FLAG }; // TEXT is the rest of the line; OPTIONAL_TEXT too, shown as [name]
+                                                                          // OPTIONAL_INT is -1 when left out
+                                                                          // FLAG is an optional word equal to its name, e.g. "-r"
 
-    for (int i = 1; i <= len1; i++) {
-        for (int j = 1; j <= len2; j++) {
-            int cost = (s1[i - 1] == s2[j - 1]) ? 0 : 1;
-            dist[i][j] = min({dist[i - 1][j] + 1, dist[i][j - 1] + 1, dist[i - 1][j - 1] + cost});
+struct ArgSpec {
+    const char* name; // Shown in usage, e.g. "filename" -> <filename>
+    ArgKind kind;
+};
+
+// Arguments parsed according to a command's schema, numbered by kind in order of appearance
+struct CommandArgs {
+    string words[2];
+    int ints[3];
+    string text;
+    bool flag = false; // The command's FLAG was given
+};
+
+using CommandHandler = bool (*)(FileSystem&, const CommandArgs&); // Returns false to end the session
+
+// How a command holds the tree while sessions share it (FileSystem::setShared). Most share it and lock
+// the directory and file they work on; anything that replaces, copies or walks whole subtrees, or runs
+// on the search pool, has it to itself. EXCLUSIVE_WITH_FLAG is EXCLUSIVE when the command's FLAG is given.
+enum class TreeAccess { SHARED, EXCLUSIVE, EXCLUSIVE_WITH_FLAG };
+
+struct CommandSpec {
+    string_view name;
+    array<ArgSpec, 4> args; // Schema, unused slots have a null name
+    const char* help; // One-line description
+    CommandHandler handler;
+    TreeAccess access = TreeAccess::SHARED;
+    bool hostPaths = false; // Reads or writes a host file named on the line: refused where Session::hostPaths is off
+};
+
+constexpr ArgSpec NO_ARG{nullptr, ArgKind::WORD};
+
+void showHelp(ostream& out);
+void showSpecificHelp(FileSystem& fs, const string& command);
+
+constexpr CommandSpec COMMANDS[] = {
+    {"create", {{{"filename", ArgKind::WORD}}}, "Create a new file in current directory",
+     [](FileSystem& fs, const CommandArgs& a) { fs.createFile(a.words[0]); return true; }},
+    {"delete", {{{"filename", ArgKind::WORD}}}, "Delete a file from current directory",
+     [](FileSystem& fs, const CommandArgs& a) { fs.deleteFile(a.words[0]); return true; }},
+    {"mkdir", {{{"dirname", ArgKind::WORD}}}, "Create a new directory",
+     [](FileSystem& fs, const CommandArgs& a) { fs.mkdir(a.words[0]); return true; }},
+    {"chdir", {{{"dirname", ArgKind::WORD}}}, "Change to specified directory (use '..' to go up, '/' for root)",
+     [](FileSystem& fs, const CommandArgs& a) { fs.chDir(a.words[0]); return true; }},
+    {"ls", {{NO_ARG}}, "Lists all files and directories in the current directory",
+     [](FileSystem& fs, const CommandArgs&) { fs.listFiles(); return true; }},
+    {"move", {{{"source", ArgKind::WORD}, {"target", ArgKind::WORD}}}, "Rename a file or move it into another directory",
+     [](FileSystem& fs, const CommandArgs& a) { fs.moveFile(a.words[0], a.words[1]); return true; }},
+    {"cp", {{{"-r", ArgKind::FLAG}, {"source", ArgKind::WORD}, {"target", ArgKind::WORD}}}, "Copy a file, or a directory with -r (contents are shared until written)",
+     [](FileSystem& fs, const CommandArgs& a) { fs.copyPath(a.words[0], a.words[1], a.flag); return true; }, TreeAccess::EXCLUSIVE_WITH_FLAG},
+    {"open", {{{"filename", ArgKind::WORD}, {"mode", ArgKind::OPTIONAL_TEXT}}}, "Open a file as a descriptor #n; mode r, w, rw (default) or a",
+     [](FileSystem& fs, const CommandArgs& a) { fs.openFile(a.words[0], a.text); return true; }},
+    {"close", {{{"file", ArgKind::WORD}}}, "Close a descriptor, or every descriptor of a file",
+     [](FileSystem& fs, const CommandArgs& a) { fs.closeFile(a.words[0]); return true; }},
+    {"write", {{{"file", ArgKind::WORD}, {"text", ArgKind::TEXT}}}, "Write text at the end of file (at the cursor of a descriptor)",
+     [](FileSystem& fs, const CommandArgs& a) { fs.writeFile(a.words[0], a.text); return true; }},
+    {"write_at", {{{"file", ArgKind::WORD}, {"pos", ArgKind::INT}, {"text", ArgKind::TEXT}}}, "Write text at specific position",
+     [](FileSystem& fs, const CommandArgs& a) { fs.writeAt(a.words[0], a.ints[0], a.text); return true; }},
+    {"read", {{{"file", ArgKind::WORD}, {"size", ArgKind::OPTIONAL_INT}}}, "Read a file, or [size] bytes of it (from the cursor of a descriptor)",
+     [](FileSystem& fs, const CommandArgs& a) { fs.readFile(a.words[0], a.ints[0]); return true; }},
+    {"read_from", {{{"file", ArgKind::WORD}, {"start", ArgKind::INT}, {"size", ArgKind::INT}}}, "Read part of file",
+     [](FileSystem& fs, const CommandArgs& a) { fs.readFrom(a.words[0], a.ints[0], a.ints[1]); return true; }},
+    {"move_within", {{{"file", ArgKind::WORD}, {"start", ArgKind::INT}, {"size", ArgKind::INT}, {"target", ArgKind::INT}}}, "Move internal file data",
+     [](FileSystem& fs, const CommandArgs& a) { fs.moveWithin(a.words[0], a.ints[0], a.ints[1], a.ints[2]); return true; }},
+    {"truncate", {{{"file", ArgKind::WORD}, {"size", ArgKind::INT}}}, "Cut file size to specified length",
+     [](FileSystem& fs, const CommandArgs& a) { fs.truncateFile(a.words[0], a.ints[0]); return true; }},
+    {"seek", {{{"fd", ArgKind::WORD}, {"pos", ArgKind::INT}}}, "Move the cursor of a descriptor",
+     [](FileSystem& fs, const CommandArgs& a) { fs.seek(a.words[0], a.ints[0]); return true; }},
+    {"handles", {{NO_ARG}}, "List open descriptors with their file, mode and cursor",
+     [](FileSystem& fs, const CommandArgs&) { fs.listHandles(); return true; }},
+    {"memory_map", {{NO_ARG}}, "Show current directory and files tree",
+     [](FileSystem& fs, const CommandArgs&) { fs.showMemoryMap(); return true; }, TreeAccess::EXCLUSIVE},
+    {"grep", {{{"dirname", ArgKind::WORD}, {"pattern", ArgKind::TEXT}}}, "Search the contents of all files under a directory",
+     [](FileSystem& fs, const CommandArgs& a) { fs.grep(a.words[0], a.text); return true; }, TreeAccess::EXCLUSIVE},
+    {"find", {{{"dirname", ArgKind::WORD}, {"pattern", ArgKind::TEXT}}}, "Find files and directories under a directory by name",
+     [](FileSystem& fs, const CommandArgs& a) { fs.find(a.words[0], a.text); return true; }, TreeAccess::EXCLUSIVE},
+    {"du", {{{"dirname", ArgKind::OPTIONAL_TEXT}}}, "Show bytes, files and directories under a directory (default: the current one)",
+     [](FileSystem& fs, const CommandArgs& a) { fs.diskUsage(a.text); return true; }},
+    {"dedup", {{NO_ARG}}, "Share identical blocks of file contents and show the space saved",
+     [](FileSystem& fs, const CommandArgs&) { fs.dedup(); return true; }, TreeAccess::EXCLUSIVE},
+    {"compression", {{{"idle", ArgKind::INT}, {"size", ArgKind::INT}}}, "Compress files unused for <idle> commands or of <size>+ bytes (0 = off)",
+     [](FileSystem& fs, const CommandArgs& a) { fs.compression(a.ints[0], a.ints[1]); return true; }, TreeAccess::EXCLUSIVE},
+    {"budget", {{{"bytes", ArgKind::INT}}}, "Keep file contents in memory under <bytes>, spilling the rest to disk (0 = off)",
+     [](FileSystem& fs, const CommandArgs& a) { fs.budget(a.ints[0]); return true; }, TreeAccess::EXCLUSIVE},
+    {"stats", {{NO_ARG}}, "Show node counts, memory use and per-command latencies",
+     [](FileSystem& fs, const CommandArgs&) { fs.printStats(fs.output()); return true; }, TreeAccess::EXCLUSIVE},
+    {"import", {{{"hostpath", ArgKind::WORD}, {"file", ArgKind::WORD}}}, "Copy a host file (any bytes, any size) into a file",
+     [](FileSystem& fs, const CommandArgs& a) { fs.importFile(a.words[0], a.words[1]); return true; }, TreeAccess::SHARED, true},
+    {"export", {{{"file", ArgKind::WORD}, {"hostpath", ArgKind::WORD}}}, "Write a file's content to a host file",
+     [](FileSystem& fs, const CommandArgs& a) { fs.exportFile(a.words[0], a.words[1]); return true; }, TreeAccess::SHARED, true},
+    {"import_dat", {{{"path", ArgKind::WORD}}}, "Replace the file system with a text .dat file",
+     [](FileSystem& fs, const CommandArgs& a) { fs.importText(a.words[0]); return true; }, TreeAccess::EXCLUSIVE, true},
+    {"export_dat", {{{"path", ArgKind::WORD}}}, "Save the file system as a text .dat file",
+     [](FileSystem& fs, const CommandArgs& a) { fs.saveToFile(a.words[0]); return true; }, TreeAccess::EXCLUSIVE, true},
+    {"help", {{{"command", ArgKind::OPTIONAL_TEXT}}}, "To show work of available commands",
+     [](FileSystem& fs, const CommandArgs& a) {
+         if (a.text.empty()) showHelp(fs.output()); // Show general help if no specific command is provided
+         else showSpecificHelp(fs, a.text); // Show help for the specific command
+         return true;
+     }},
+    {"exit", {{NO_ARG}}, "Exit the program",
+     [](FileSystem&, const CommandArgs&) { return false; }},
+};
+constexpr size_t COMMAND_COUNT = sizeof(COMMANDS) / sizeof(COMMANDS[0]);
+
+
+// Compile-time perfect hash over the command names: FNV-1a with a seed searched at compile time
+// so that every name lands in its own slot. Dispatch is one hash, one table load and one compare.
+constexpr size_t COMMAND_SLOTS = 64; // Power of two, comfortably above COMMAND_COUNT
+
+constexpr uint32_t commandHash(string_view s, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (char c : s) h = (h ^ uint8_t(c)) * 16777619u;
+    return h ^ (h >> 15);
+}
+
+constexpr bool seedIsPerfect(uint32_t seed) {
+    bool used[COMMAND_SLOTS] = {};
+    for (size_t i = 0; i < COMMAND_COUNT; i++) {
+        size_t slot = commandHash(COMMANDS[i].name, seed) & (COMMAND_SLOTS - 1);
+        if (used[slot]) return false;
+        used[slot] = true;
+    }
+    return true;
+}
+
+constexpr uint32_t findCommandSeed() {
+    for (uint32_t seed = 0; seed < 100000; seed++) {
+        if (seedIsPerfect(seed)) return seed;
+    }
+    return UINT32_MAX;
+}
+
+constexpr uint32_t COMMAND_SEED = findCommandSeed();
+static_assert(COMMAND_SEED != UINT32_MAX, "No perfect hash seed for the command table");
+
+constexpr array<uint8_t, COMMAND_SLOTS> buildCommandSlots() {
+    array<uint8_t, COMMAND_SLOTS> slots{}; // Command index + 1, 0 for an empty slot
+    for (size_t i = 0; i < COMMAND_COUNT; i++) {
+        slots[commandHash(COMMANDS[i].name, COMMAND_SEED) & (COMMAND_SLOTS - 1)] = i + 1;
+    }
+    return slots;
+}
+
+constexpr array<uint8_t, COMMAND_SLOTS> COMMAND_TABLE = buildCommandSlots();
+
+// Registry entry for a command name, or nullptr
+constexpr const CommandSpec* findCommand(string_view name) {
+    uint8_t entry = COMMAND_TABLE[commandHash(name, COMMAND_SEED) & (COMMAND_SLOTS - 1)];
+    if (entry == 0 || COMMANDS[entry - 1].name != name) return nullptr;
+    return &COMMANDS[entry - 1];
+}
+
+// Every entry is found under its own name, nothing else is found, and every schema fits in CommandArgs
+constexpr bool commandTableIsConsistent() {
+    for (const CommandSpec& c : COMMANDS) {
+        if (findCommand(c.name) != &c) return false;
+        size_t words = 0, ints = 0, texts = 0, flags = 0;
+        for (const ArgSpec& arg : c.args) {
+            if (!arg.name) break;
+            if (arg.kind == ArgKind::WORD) words++;
+            else if (arg.kind == ArgKind::INT || arg.kind == ArgKind::OPTIONAL_INT) ints++;
+            else if (arg.kind == ArgKind::TEXT || arg.kind == ArgKind::OPTIONAL_TEXT) texts++;
+            else flags++;
         }
+        if (words > extent_v<decltype(CommandArgs::words)> || ints > extent_v<decltype(CommandArgs::ints)> || texts > 1 || flags > 1) return false;
+    }
+    return findCommand("nope") == nullptr;
+}
+static_assert(commandTableIsConsistent(), "Command table is inconsistent");
+
+
+// "name <arg> <arg>" as shown in help and the menu
+string commandUsage(const CommandSpec& spec) {
+    string usage(spec.name);
+    for (const ArgSpec& arg : spec.args) {
+        if (!arg.name) break;
+        if (arg.kind == ArgKind::OPTIONAL_TEXT || arg.kind == ArgKind::OPTIONAL_INT || arg.kind == ArgKind::FLAG) usage += string(" [") + arg.name + "]";
+        else usage += string(" <") + arg.name + ">";
     }
+    return usage;
+}
 
-    return dist[len1][len2];
+// Parse the rest of a command line according to the command's schema
+bool parseArgs(const CommandSpec& spec, istringstream& in, CommandArgs& out) {
+    int words = 0, ints = 0;
+    for (const ArgSpec& arg : spec.args) {
+        if (!arg.name) break;
+        if (arg.kind == ArgKind::WORD) {
+            if (!(in >> out.words[words++])) return false;
+        } else if (arg.kind == ArgKind::INT) {
+            if (!(in >> out.ints[ints++])) return false;
+        } else if (arg.kind == ArgKind::OPTIONAL_INT) {
+            string word;
+            out.ints[ints] = -1;
+            if (in >> word) {
+                istringstream number(word);
+                if (!(number >> out.ints[ints]) || !number.eof()) return false;
+            }
+            ints++;
+        } else if (arg.kind == ArgKind::FLAG) {
+            streampos before = in.tellg();
+            string word;
+            if (in >> word && word == arg.name) {
+                out.flag = true;
+            } else {
+                in.clear();
+                in.seekg(before); // Not the flag, leave the word for the next argument
+            }
+        } else {
+            getline(in, out.text); // Rest of the line (allows spaces)
+            if (!out.text.empty() && out.text[0] == ' ') out.text = out.text.substr(1); // Remove leading space if present
+        }
+    }
+    return true;
 }
 
-vector<string> commands = {
-    "create <filename>",
-    "delete <filename>",
-    "mkdir <dirname>",
-    "chdir <dirname>",
-    "ls",
-    "move <source> <target>",
-    "open <filename>",
-    "close <filename>",
-    "write <filename> <text>",
-    "write_at <filename> <pos> <text>",
-    "read <filename>",
-    "read_from <filename> <start> <size>",
-    "move_within <filename> <start> <size> <target>",
-    "truncate <filename> <size>",
-    "memory_map",
-    "help",
-    "exit"
-};
+void showHelpLine(ostream& out, size_t index) {
+    string usage = commandUsage(COMMANDS[index]);
+    out << setw(2) << setfill('0') << index + 1 << setfill(' ') << ". " << left << setw(37) << usage << right
+         << (usage.size() >= 37 ? " - " : "- ") << COMMANDS[index].help << '\n';
+}
+
+void showHelp(ostream& out) {
+    out << "Available Commands:\n";
+    for (size_t i = 0; i < COMMAND_COUNT; i++) showHelpLine(out, i);
+}
 
-void suggestCommand(const string& userCommand) {
-    int minDist = INT_MAX;
-    string closestCommand;
+// Function to show specific help
+void showSpecificHelp(FileSystem& fs, const string& command) {
+    const CommandSpec* spec = findCommand(command);
+    if (spec) {
+        showHelpLine(fs.output(), spec - COMMANDS);
+    } else {
+        fs.markFailed();
+        fs.output() << "Unknown command. Use 'help' to see the list of available commands.\n";
+    }
+}
 
-    // Check each command and calculate Levenshtein distance
-    for (const string& command : commands) {
-        int dist = levenshtein(userCommand, command);
+// Suggest the registered command closest to a mistyped name
+void suggestCommand(ostream& out, const string& userCommand) {
+    int limit = suggestionLimit(userCommand.size());
+    int minDist = limit + 1;
+    const CommandSpec* closest = nullptr;
+    for (const CommandSpec& spec : COMMANDS) {
+        int dist = editDistance(userCommand, spec.name, minDist - 1); // Only a strictly closer name matters
         if (dist < minDist) {
             minDist = dist;
-            closestCommand = command;
+            closest = &spec;
         }
     }
 
-    // Suggest the closest command
-    if (minDist > 3) {  // Only suggest if the command is reasonably close (optional threshold)
-        cout << "Unknown command. No similar command found.\n";
+    if (!closest) {
+        out << "Unknown command. No similar command found.\n";
     } else {
-        cout << "Did you mean: '" << closestCommand << "'?\n";
+        out << "Did you mean: '" << commandUsage(*closest) << "'?\n";
     }
 }
 
 void menu() {
-    cout << "\nCommands:\n"
-         << "01. create <filename>\n"
-         << "02. delete <filename>\n"
-         << "03. mkdir <dirname>\n"
-         << "04. chdir <dirname>\n"
-         << "05. move <source> <target>\n"
-         << "06. open <filename>\n"
-         << "07. close <filename>\n"
-         << "08. write <filename> <text>\n"
-         << "09. write_at <filename> <pos> <text>\n"
-         << "10. read <filename>\n"
-         << "11. read_from <filename> <start> <size>\n"
-         << "12. move_within <filename> <start> <size> <target>\n"
-         << "13. truncate <filename> <size>\n"
-         << "14. memory_map\n"
-         << "15. help\n"
-         << "16. ls\n"
-         << "17. exit\n";
+    cout << "\nCommands:\n";
+    for (size_t i = 0; i < COMMAND_COUNT; i++) {
+        cout << setw(2) << setfill('0') << i + 1 << setfill(' ') << ". " << commandUsage(COMMANDS[i]) << '\n';
+    }
+}
+
+// Run one command line through the registry. Returns false once the session should end.
+bool runCommand(FileSystem& fs, const string& line) {
+    istringstream in(line);
+    string cmd;
+    if (!(in >> cmd)) return true;  // Blank line
+    const CommandSpec* spec = findCommand(cmd);
+    if (!spec) {
+        fs.markFailed();
+        suggestCommand(fs.output(), cmd);  // Handle invalid commands by suggesting similar commands
+        return true;
+    }
+    CommandArgs args;
+    if (!parseArgs(*spec, in, args)) {
+        fs.markFailed();
+        fs.output() << "Invalid arguments. Usage: " << commandUsage(*spec) << '\n';
+        return true;
+    }
+    if (spec->hostPaths && !fs.hostPathsAllowed()) {
+        fs.markFailed();
+        fs.output() << "'" << spec->name << "' reads or writes host files, which a server session can't do.\n";
+        return true;
+    }
+#ifndef FS_NO_STATS
+    static const vector<LatencyHistogram*> latencies = [] { // One latency histogram per command
+        vector<LatencyHistogram*> all;
+        for (const CommandSpec& c : COMMANDS) all.push_back(&Stats::instance().histogram(string(c.name)));
+        return all;
+    }();
+    ScopedLatency timer(*latencies[spec - COMMANDS]); // In shared mode this includes waiting for the tree
+#endif
+    auto lock = fs.beginCommand(spec->access == TreeAccess::EXCLUSIVE || (spec->access == TreeAccess::EXCLUSIVE_WITH_FLAG && args.flag));
+    return spec->handler(fs, args);
 }
\ No newline at end of file
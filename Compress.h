@@ -0,0 +1,135 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std;
+
+
+// Small LZ4 block codec (the LZ4 block format, written from its specification; no external library).
+// A block is a run of sequences: a token whose high nibble is the literal length and low nibble the
+// match length - 4 (15 in either means more length bytes follow, 255 at a time), the literals, a
+// 2-byte little-endian offset back into the output, and nothing more for the last sequence, which is
+// literals only. The compressor is the greedy single-probe kind: one 4-byte hash table lookup per
+// position, skipping faster through data that doesn't match, so it runs at memory-copy-like speeds
+// and gives up ratio for it.
+namespace lz4 {
+    constexpr int HASH_BITS = 12; // 4096-entry match finder, 32 KB
+    constexpr size_t MIN_MATCH = 4;
+    constexpr size_t LAST_LITERALS = 5; // The format wants the last bytes as literals...
+    constexpr size_t MATCH_LIMIT = 12; // ...and no match starting this close to the end
+    constexpr size_t MAX_OFFSET = 65535;
+
+    // Largest compressed size of n bytes (incompressible input, plus length bytes)
+    inline size_t bound(size_t n) { return n + n / 255 + 16; }
+
+    inline uint32_t read32(const char* p) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return v;
+    }
+
+    inline uint32_t hash4(uint32_t v) { return (v * 2654435761u) >> (32 - HASH_BITS); }
+
+    // Length as the token nibble already holds 15 of it: 255s, then the remainder
+    inline char* putLength(char* op, size_t len) {
+        for (; len >= 255; len -= 255) *op++ = char(255);
+        *op++ = char(len);
+        return op;
+    }
+
+    inline char* putSequence(char* op, const char* literals, size_t literalLength) {
+        char* token = op++;
+        *token = char((literalLength >= 15 ? 15 : literalLength) << 4);
+        if (literalLength >= 15) op = putLength(op, literalLength - 15);
+        memcpy(op, literals, literalLength);
+        return op + literalLength;
+    }
+
+    inline string compress(string_view in) {
+        string out(bound(in.size()), '\0');
+        char* op = &out[0];
+        const char* base = in.data();
+        const char* ip = base;
+        const char* anchor = base; // Start of the literals not yet emitted
+        const char* end = base + in.size();
+        if (in.size() > MATCH_LIMIT) {
+            vector<size_t> table(size_t(1) << HASH_BITS, 0); // Position of the last 4 bytes with each hash
+            const char* limit = end - MATCH_LIMIT;
+            size_t misses = 0;
+            while (ip < limit) {
+                uint32_t seq = read32(ip);
+                uint32_t h = hash4(seq);
+                const char* ref = base + table[h];
+                table[h] = ip - base;
+                if (ref >= ip || size_t(ip - ref) > MAX_OFFSET || read32(ref) != seq) {
+                    ip += 1 + (misses++ >> 6); // Step further the longer nothing matches
+                    continue;
+                }
+                misses = 0;
+                const char* matchEnd = ip + MIN_MATCH;
+                const char* matchLimit = end - LAST_LITERALS;
+                for (const char* r = ref + MIN_MATCH; matchEnd < matchLimit && *matchEnd == *r; r++) matchEnd++;
+
+                char* token = op;
+                op = putSequence(op, anchor, ip - anchor);
+                uint16_t offset = uint16_t(ip - ref);
+                *op++ = char(offset & 0xFF);
+                *op++ = char(offset >> 8);
+                size_t matchLength = matchEnd - ip - MIN_MATCH;
+                *token |= char(matchLength >= 15 ? 15 : matchLength);
+                if (matchLength >= 15) op = putLength(op, matchLength - 15);
+                ip = anchor = matchEnd;
+            }
+        }
+        op = putSequence(op, anchor, end - anchor);
+        out.resize(op - out.data());
+        return out;
+    }
+
+    // Decode a block into exactly rawSize bytes at out. Returns false, without reading or writing out of
+    // bounds, for anything that isn't a well-formed block of that size.
+    inline bool decompress(string_view in, char* out, size_t rawSize) {
+        const uint8_t* ip = (const uint8_t*)in.data();
+        const uint8_t* iend = ip + in.size();
+        char* op = out;
+        char* oend = out + rawSize;
+        auto getLength = [&](size_t& len) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return false;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+            return true;
+        };
+        while (ip < iend) {
+            uint8_t token = *ip++;
+            size_t literals = token >> 4;
+            if (literals == 15 && !getLength(literals)) return false;
+            if (literals > size_t(iend - ip) || literals > size_t(oend - op)) return false;
+            memcpy(op, ip, literals);
+            ip += literals;
+            op += literals;
+            if (ip == iend) break; // Last sequence: literals only
+            if (iend - ip < 2) return false;
+            size_t offset = ip[0] | (size_t(ip[1]) << 8);
+            ip += 2;
+            if (offset == 0 || offset > size_t(op - out)) return false;
+            size_t length = token & 15;
+            if (length == 15 && !getLength(length)) return false;
+            length += MIN_MATCH;
+            if (length > size_t(oend - op)) return false;
+            const char* match = op - offset;
+            if (offset >= length) {
+                memcpy(op, match, length);
+                op += length;
+            } else {
+                while (length--) *op++ = *match++; // Overlapping: repeats the last `offset` bytes
+            }
+        }
+        return op == oend;
+    }
+}
@@ -1,72 +1,209 @@
 #pragma once
 
 using namespace std; // Use standard namespace
+#include <functional>
 #include <iostream> // Include iostream for input/output operations
+#include <memory>
+#include "Compress.h" // LZ4 codec for cold contents
+#include "Rope.h" // Piece-table storage for file content
+
+
+// Compressed content of a cold file. Immutable, so copies of the tree share it.
+struct PackedContent {
+    string bytes; // LZ4 block
+    size_t rawSize; // Length of the content it decodes to
+};
+
+// Content of a file that is still on disk, in a snapshot (see Snapshot::openLazy) or spilled to the
+// page store (see PageStore.h), loaded on first use
+class StoredContent {
+    public:
+        virtual ~StoredContent() = default;
+        virtual size_t size() const = 0;
+        virtual string bytes() const = 0; // Plain copy, safe on any thread
+        virtual Rope load() const = 0; // Built from block store blocks (safe from any thread)
+        virtual void forEachPiece(uint64_t from, uint64_t count, const function<void(string_view)>& visit) const = 0; // In place, no copy
+};
 
 
 class File {
     public:
-        string name; // Name of the file
-        string content; // Content of the file
-        bool is_open; // Flag to check if the file is open
+        Rope content; // Content of the file, stored as a piece table so edits splice instead of copying
+        uint32_t descriptors; // Descriptors open on the file, in every session; while any are, it can't be deleted
+        shared_ptr<const PackedContent> packed; // Set while the file is compressed; content is empty then
+        shared_ptr<const StoredContent> stored; // Set until a lazily opened file is first used; content is empty then
+        uint64_t lastAccess = 0; // Command clock of the last read or edit, 0 for never (see FileSystem)
+        size_t charged = 0; // Bytes last counted against the memory budget (see NodeArena::recharge)
     
-        File(string name = "") : name(name), is_open(false) {} // Constructor to initialize file
+        File() : descriptors(0) {} // Constructor to initialize file (its name lives in the node arena)
+
+        bool compressed() const { return packed != nullptr; }
+        size_t size() const { return packed ? packed->rawSize : stored ? stored->size() : content.size(); }
+        size_t residentSize() const { return packed ? packed->bytes.size() : stored ? 0 : content.size(); } // Content bytes held in memory
+
+        // Whole content for reading without warming the file up: a cold or not yet loaded file is
+        // decoded into a temporary rope that lives as long as the view. Like every method taking err, it
+        // reports problems there: the output of the command that asked, cerr for background work.
+        Rope::View view(ostream& err) const {
+            if (packed) return Rope(unpack(err)).view();
+            if (stored) return Rope(stored->bytes()).view();
+            return content.view();
+        }
+
+        // Visit [from, from + count) of the content piece by piece without warming the file up: a file
+        // still in a snapshot is read in place from the mapping, a compressed one decoded into a temporary
+        template <typename Visitor>
+        void forEachPiece(size_t from, size_t count, Visitor visit, ostream& err) const {
+            if (packed) {
+                string raw = unpack(err);
+                visit(string_view(raw).substr(from, count));
+            } else if (stored) {
+                stored->forEachPiece(from, count, visit);
+            } else {
+                content.view(from, count).forEachPiece(visit);
+            }
+        }
+
+        // Compress the content, unless it is empty or would shrink by less than an eighth
+        bool compress() {
+            if (packed || content.empty()) return false;
+            string raw = content.str();
+            string bytes = lz4::compress(raw);
+            if (bytes.size() > raw.size() - raw.size() / 8) return false;
+            bytes.shrink_to_fit();
+            packed = make_shared<const PackedContent>(PackedContent{move(bytes), raw.size()});
+            content = Rope();
+            return true;
+        }
+
+        // Let go of the content in memory for a copy of it kept on disk, read back like a lazily opened file
+        void spill(shared_ptr<const StoredContent> copy) {
+            stored = move(copy);
+            content = Rope();
+            packed.reset();
+        }
+
+        // Bring a compressed or not yet loaded file into a rope; every content method does this first
+        void thaw(ostream& err) {
+            if (packed) {
+                content = Rope(unpack(err));
+                packed.reset();
+            } else if (stored) {
+                content = stored->load();
+                stored.reset();
+            }
+        }
+
+        // Take over another file's content, sharing its pieces or its compressed block
+        void shareContent(const File& other) {
+            content = other.content;
+            packed = other.packed;
+            stored = other.stored;
+        }
+
+        // Heap bytes of the content in its current form
+        size_t memoryUsage() const {
+            if (packed) return sizeof(PackedContent) + packed->bytes.capacity();
+            return content.memoryUsage(); // A stored file has nothing in memory yet
+        }
     
-        void write_to_file(const string& text) {
-            content += text; // Append text to the file content
+        void write_to_file(const string& text, ostream& err) {
+            thaw(err);
+            content.append(text); // Append text to the file content
         }
     
-        void write_at(int pos, const string& text) {
-            if (pos >= 0 && pos <= content.size()) {
-                content.replace(pos, text.size(), text); // Replace as normal
-            } else if (pos > content.size()) {
-                content += string(pos - content.size(), ' '); // Pad with spaces
-                content += text; // Append text after padding
+        bool write_at(int pos, const string& text, ostream& err) {
+            thaw(err);
+            size_t size = content.size();
+            if (pos >= 0 && (size_t)pos <= size) {
+                content.replace(pos, text.size(), text); // Overwrite as normal, growing past the end if needed
+            } else if (pos > 0) {
+                content.append(string(pos - size, ' ')); // Pad with spaces
+                content.append(text); // Append text after padding
+            } else {
+                err << "Error: Position cannot be negative.\n"; // Handle negative position error
+                return false;
             }
+            return true;
         }
         
     
-        string read_from_file() {
-            return content; // Return the entire file content
+        Rope::View read_from_file(ostream& err) {
+            thaw(err);
+            return content.view(); // View of the entire file content
         }
     
-        string read_from(int start, int size) {
-            // Check for invalid start position
-            if (start < 0 || start >= content.size()) {
-                cerr << "Error: Start position out of bounds." << endl;
-                return "";
-            }
-        
-            // If requested size goes beyond content, adjust it
-            if (start + size > content.size()) {
-                cerr << "Warning: Requested size exceeds file content. Truncating read." << endl;
-                size = content.size() - start;
-            }
-        
-            // Return the valid substring
-            return content.substr(start, size);
+        Rope::View read_from(int start, int size, ostream& err) {
+            thaw(err);
+            if (!clampRead(start, size, err)) return Rope::View();
+            return content.view(start, size); // View of the valid range, no copy is made
+        }
+
+        // read_from_file() and read_from() written straight to out, piece by piece, with any warning ahead
+        // of the text. A file still in a snapshot is streamed from the mapping and stays there; anything
+        // else is thawed like any read.
+        void print(ostream& out) {
+            if (!stored) out << read_from_file(out);
+            else forEachPiece(0, size(), [&](string_view piece) { out.write(piece.data(), piece.size()); }, out);
+        }
+
+        void print(ostream& out, int start, int size) {
+            if (!stored) out << read_from(start, size, out);
+            else if (clampRead(start, size, out)) forEachPiece(start, size, [&](string_view piece) { out.write(piece.data(), piece.size()); }, out);
         }
         
     
-        void move_within_file(int start, int size, int target) {
-            if (start >= 0 && start + size <= content.size() && target >= 0 && target <= content.size()) {
-                string movingText = content.substr(start, size); // Extract the text to move
-                content.erase(start, size); // Remove the text from the original position
-                content.insert(target, movingText); // Insert the text at the target position
-            } else if (start < 0 || start + size > content.size()) {
-                cerr << "Error: Start position or size out of bounds." << endl; // Handle out of bounds error
-            } else if (target < 0 || target > content.size()) {
-                cerr << "Error: Target position out of bounds." << endl; // Handle out of bounds error
+        bool move_within_file(int start, int size, int target, ostream& err) {
+            thaw(err);
+            size_t length = content.size();
+            if (start < 0 || size < 0 || (size_t)start + size > length) {
+                err << "Error: Start position or size out of bounds.\n"; // Handle out of bounds error
+            } else if (target < 0 || (size_t)target > length - size) {
+                err << "Error: Target position out of bounds.\n"; // Target is measured after the text is taken out
+            } else {
+                content.relocate(start, size, target); // Splice the range out and back in at the target
+                return true;
             }
+            return false;
         }
     
-        void truncate_file(int maxSize) {
-            if (maxSize >= 0 && maxSize < content.size()) {
-                content = content.substr(0, maxSize); // Truncate the file content to the specified size
+        bool truncate_file(int maxSize, ostream& err) {
+            thaw(err);
+            if (maxSize >= 0 && (size_t)maxSize < content.size()) {
+                content.truncate(maxSize); // Drop every piece past the new size
+                return true;
             } else if (maxSize < 0) {
-                cerr << "Error: Size cannot be negative." << endl; // Handle negative size error
+                err << "Error: Size cannot be negative.\n"; // Handle negative size error
             } else {
-                cerr << "Warning: Size exceeds current content. No truncation performed." << endl; // Handle size exceeding content
+                err << "Warning: Size exceeds current content. No truncation performed.\n"; // Handle size exceeding content
+            }
+            return false;
+        }
+
+    private:
+        // Check a read of size bytes at start, cutting size to what is there (all of it if negative)
+        bool clampRead(int start, int& size, ostream& err) const {
+            size_t length = this->size();
+
+            // Check for invalid start position
+            if (start < 0 || (size_t)start >= length) {
+                err << "Error: Start position out of bounds.\n";
+                return false;
+            }
+        
+            // If requested size goes beyond content (or is negative), read up to the end
+            if (size < 0) {
+                size = length - start;
+            } else if ((size_t)start + size > length) {
+                err << "Warning: Requested size exceeds file content. Truncating read.\n";
+                size = length - start;
             }
+            return true;
+        }
+
+        string unpack(ostream& err) const {
+            string raw(packed->rawSize, '\0');
+            if (!lz4::decompress(packed->bytes, &raw[0], raw.size())) err << "Error: Compressed content is damaged.\n";
+            return raw;
         }
     };
\ No newline at end of file
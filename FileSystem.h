@@ -1,262 +1,1609 @@
 #pragma once
 #include <iostream>
 #include <fstream>
+#include <iomanip>
 #include <string>
 #include <map>
 #include <vector>
 #include <algorithm>
-#include "Directory.h"
+#include <climits>
+#include <atomic>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "NodeArena.h"
+#include "PageStore.h"
+#include "Journal.h"
+#include "Snapshot.h"
+#include "FuzzyMatch.h"
+#include "Search.h"
+#include "ThreadPool.h"
+#include "Stats.h"
 
 using namespace std;
 
 class FileSystem {
+    public:
+        // Open files. A descriptor ("#<n>" on the command line, n = slot + 1) stays bound to its node
+        // wherever the file is moved, so data commands given one skip name resolution altogether, and
+        // it keeps a cursor that sequential reads and writes advance.
+        enum OpenMode : uint8_t { READ = 1, WRITE = 2, APPEND = 4 }; // APPEND: every write goes to the end
+        struct Handle {
+            NodeId node = NO_NODE; // NO_NODE for a free slot
+            uint32_t serial = 0; // NodeArena::serial() at open time: the slot of a deleted file may be reused
+            uint8_t mode = 0;
+            size_t cursor = 0;
+        };
+
+        // What one client sees of the file system: the shell has one, and each server connection its own
+        // (see enterSession). Commands print to out.
+        struct Session {
+            NodeId currentDir = NodeArena::ROOT; // Current working directory
+            uint32_t dirSerial = 0; // NodeArena::serial() of currentDir, checked at the start of each command
+            vector<Handle> handles;
+            ostream* out = &cout;
+            bool failed = false; // Set when the current command reported an error
+            bool unsynced = false; // The current command journaled a change, see syncCommand()
+            bool hostPaths = true; // May name host files (import, export, import_dat, export_dat); off for server connections
+        };
+
     private:
-        Directory root; // Root directory of the file system
-        Directory* currentDir; // Pointer to the current working directory
-        vector<string> path;      // Tracks the current directory path (relative to root)
-    
-        // Help map for command descriptions
-        vector<pair<string, string>> helpMap = {
-            {"create", "01. create <filename>                    - Create a new file in current directory"},
-            {"delete", "02. delete <filename>                    - Delete a file from current directory"},
-            {"mkdir", "03. mkdir <dirname>                      - Create a new directory"},
-            {"chdir", "04. chdir <dirname>                      - Change to specified directory (use '..' to go up)"},
-            {"ls", "05. ls                                   - Lists all files and directories in the current directory"},
-            {"move", "06. move <source> <target>               - Rename/move a file"},
-            {"open", "07. open <filename>                      - Open a file for writing"},
-            {"close", "08. close <filename>                     - Close an opened file"},
-            {"write", "09. write <filename> <text>              - Write text at the end of file"},
-            {"write_at", "10. write_at <filename> <pos> <text>     - Write text at specific position"},
-            {"read", "11. read <filename>                      - Read entire file content"},
-            {"read_from", "12. read_from <filename> <start> <size>  - Read part of file"},
-            {"move_within", "13. move_within <filename> <start> <size> <target> - Move internal file data"},
-            {"truncate", "14. truncate <filename> <size>           - Cut file size to specified length"},
-            {"memory_map", "15. memory_map                           - Show current directory and files tree"},
-            {"help", "16. help                                 - To show work of available commands"},
-            {"exit", "17. exit                                 - Exit the program"}
+        NodeArena tree; // Every directory and file, with NodeArena::ROOT as the root directory
+        Session shell; // Used by any thread that hasn't entered a session of its own
+        static inline thread_local Session* active = nullptr;
+
+        // Persistence: snapshot + write-ahead journal (see openStorage)
+        static constexpr uint64_t CHECKPOINT_BYTES = 1 << 20; // Journal size that triggers a background checkpoint
+        string snapshotFile;      // Snapshot this session persists to ("" until openStorage)
+        uint32_t journalGen = 0;  // Generation of the journal being appended to
+        uint32_t oldestJournal = 0; // Oldest journal generation not yet folded into the snapshot
+        Journal journal;
+        thread checkpointer;      // Background snapshot writer
+        atomic<bool> checkpointDone{true}, checkpointOk{true};
+        atomic<bool> checkpointDue{false}; // The journal outgrew CHECKPOINT_BYTES, see checkpointIfLarge
+
+        bool lazyLoad = false; // See setLazyLoad
+        NameSuggester suggester; // "Did you mean" hints for paths that don't resolve
+        mutex suggesterLock;
+
+        // Shared mode (see setShared): commands of several sessions run at once. Each command holds
+        // treeLock, exclusively only if it replaces, copies or walks whole subtrees (CommandSpec::access).
+        // Under it a command locks the directory it works in, exclusively if it adds, removes or renames
+        // entries there, so a create in /a doesn't wait for anything in /b; content reads and edits then
+        // lock the file they work on as well. Locks are taken in that order: tree, directories (two at a
+        // time only in index order, see lockDirs), file. Directories are never removed or renamed while
+        // the tree is shared, so one found under the tree lock stays put for the command. Access stamps
+        // and descriptor counts are under ledger.
+        static constexpr size_t DIR_LOCKS = 256; // Directories share locks by node id modulo this
+        static constexpr size_t FILE_LOCKS = 1024; // Files share locks by node id modulo this
+        static constexpr uint64_t MAINTENANCE_INTERVAL = 64; // Commands between two runs of endCommand()
+        bool sharing = false;
+        shared_mutex treeLock;
+        unique_ptr<shared_mutex[]> dirLocks, fileLocks;
+        mutex ledger;
+        atomic<uint64_t> sharedCommands{0};
+
+        // Held for a command (on the tree), on a directory, or while a command reads or edits a file; empty
+        // outside shared mode
+        struct Lock {
+            shared_lock<shared_mutex> reading;
+            unique_lock<shared_mutex> writing;
         };
-    public:
-    FileSystem() : root("root", nullptr), currentDir(&root) {
-        // Initialize the path as empty, meaning we're at the root
-        path.push_back(""); // Root is the starting point but not shown in the path
-    }
-    
-        // Function to display the current path (excluding root)
-        void displayPath() {
-            if (path.size() == 1 && path[0] == "") {
-                cout << "> "; // Just root, so no path
+
+        static Lock take(shared_mutex& m, bool exclusive) {
+            Lock lock;
+            if (exclusive) lock.writing = unique_lock<shared_mutex>(m);
+            else lock.reading = shared_lock<shared_mutex>(m);
+            return lock;
+        }
+
+        // Search (grep/find) and text saves and loads run on a work-stealing pool, created on first use;
+        // snapshot saves and loads use the same number of threads
+        static constexpr size_t SNIPPET = 20; // Bytes of context printed on each side of a match
+        static constexpr size_t OUTPUT_CHUNK = 1 << 16; // A worker flushes its results once it has this much
+        static constexpr size_t IMPORT_WINDOW = 8 << 20; // Bytes of a host file mapped in at a time by import (and copied at a time by export)
+        static constexpr size_t EXPORT_BATCH = 256; // Pieces gathered per writev() by export
+        size_t threads = max(1u, thread::hardware_concurrency());
+        unique_ptr<WorkStealingPool> pool;
+        mutex searchOutput; // Held by a worker while it prints
+
+        // Cold contents are compressed (see setCompression): files nobody touched for compressIdle
+        // commands, and files of compressSize bytes or more as soon as the command using them is done
+        uint64_t accessClock = 1; // Advanced after every command, stamped into File::lastAccess
+        uint64_t compressIdle = 0; // 0 turns the age rule off
+        size_t compressSize = 0; // 0 turns the size rule off
+        deque<pair<NodeId, uint64_t>> recentFiles; // (file, clock) per access, oldest first; stale once the file is touched again
+
+        // Memory budget (see setMemoryBudget): once the contents held in memory outgrow it, the files used
+        // longest ago are spilled to the page store until they fit again
+        size_t memoryBudget = 0; // 0 turns it off
+        shared_ptr<PageStore> pages; // Created by the first spill
+        deque<pair<NodeId, uint64_t>> residentFiles; // Same as recentFiles, for the files the budget may spill
+
+        string journalName(uint32_t gen) const { return snapshotFile + ".journal." + to_string(gen); }
+
+        void record(const JournalRecord& r) {
+            if (!journal.isOpen()) return;
+            if (journal.append(r)) session().unsynced = true;
+            else journalFailed();
+            checkpointIfLarge();
+        }
+
+        // The journal stopped taking records: the change is made, but in memory only
+        void journalFailed() { error() << "Error: The journal can't be written, so this change is not durable.\n"; }
+
+        // Fold a journal that has grown past CHECKPOINT_BYTES once the command is done (see endCommand).
+        // A checkpoint copies the tree, which must not catch a command half way: a delete is journaled
+        // before the node goes, and in shared mode other sessions are editing it.
+        void checkpointIfLarge() {
+            if (journal.size() > CHECKPOINT_BYTES) checkpointDue = true;
+        }
+
+        // Report a failed command: sets the status checked by commandFailed() and returns the output stream
+        ostream& error() {
+            session().failed = true;
+            return out();
+        }
+
+        Session& session() { return active ? *active : shell; }
+        ostream& out() { return *session().out; }
+        NodeId cwd() { return session().currentDir; }
+
+        Lock lockFile(NodeId node, bool exclusive) { return sharing ? take(fileLocks[node % FILE_LOCKS], exclusive) : Lock(); }
+        Lock lockDir(NodeId dir, bool exclusive) { return sharing ? take(dirLocks[dir % DIR_LOCKS], exclusive) : Lock(); }
+
+        // Lock two directories exclusively (either may be NO_NODE), in the order every session takes them
+        pair<Lock, Lock> lockDirs(NodeId a, NodeId b) {
+            if (!sharing) return {};
+            if (a == NO_NODE || (b != NO_NODE && a % DIR_LOCKS > b % DIR_LOCKS)) swap(a, b);
+            if (a == NO_NODE) return {};
+            Lock first = lockDir(a, true);
+            if (b == NO_NODE || b % DIR_LOCKS == a % DIR_LOCKS) return {move(first), Lock()};
+            return {move(first), lockDir(b, true)};
+        }
+
+        // Lock the directory of the node stamped serial in slot node; false if that node is gone. The
+        // node may move to another directory until we hold its own, so that is checked once we do.
+        bool lockParent(NodeId node, uint32_t serial, bool exclusive, Lock& lock) {
+            for (NodeId dir = tree.parentOf(node, serial); dir != NO_NODE; dir = tree.parentOf(node, serial)) {
+                lock = lockDir(dir, exclusive);
+                if (tree.parentOf(node, serial) == dir) return true;
+                lock = Lock();
+            }
+            return false;
+        }
+
+        // Reading a compressed file decodes it back into the file, which takes the file to itself
+        Lock lockForRead(NodeId node) {
+            Lock lock = lockFile(node, false);
+            if (lock.reading && tree.file(node).compressed()) {
+                lock.reading.unlock();
+                lock = lockFile(node, true);
+            }
+            return lock;
+        }
+
+        // Join a finished (or, with wait, a running) checkpoint and retire the journals it folded in
+        void finishCheckpoint(bool wait) {
+            if (!checkpointer.joinable() || (!wait && !checkpointDone)) return;
+            checkpointer.join();
+            if (checkpointOk) {
+                oldestJournal = journalGen;
+            } else {
+                out() << "Warning: Checkpoint failed, the journal is kept instead.\n";
+            }
+        }
+
+        // Re-apply a journaled mutation. Records were only written for commands that succeeded, so this
+        // mirrors the commands without their checks and messages.
+        void applyRecord(const JournalRecord& r) {
+            NodeId dir = NodeArena::ROOT;
+            for (const string& part : r.dir) {
+                dir = childOf(dir, part);
+                if (dir == NO_NODE || !tree.isDir(dir)) return; // Can't happen for a journal that matches its snapshot
+            }
+            NodeId node = childOf(dir, r.name);
+            if (r.op == JournalRecord::MKDIR || r.op == JournalRecord::CREATE) {
+                if (node != NO_NODE) return;
+                if (r.op == JournalRecord::MKDIR) tree.addDir(dir, r.name);
+                else tree.addFile(dir, r.name);
                 return;
             }
-        
-            for (size_t i = 1; i < path.size(); ++i) { // Skip the root marker ""
-                if (i > 1) cout << ">";
-                cout << path[i];
+            if (r.op == JournalRecord::COPY) { // text is the absolute destination path
+                NodeId target;
+                string name;
+                if (node == NO_NODE || !splitPath(NodeArena::ROOT, r.text, target, name)) return;
+                NodeId existing = childOf(target, name);
+                if (existing != NO_NODE) tree.remove(existing);
+                tree.copyNode(node, target, tree.intern(name));
+                return;
             }
-            cout << "> ";
+            if (node == NO_NODE || tree.isDir(node)) return;
+            File& file = tree.file(node);
+            switch (r.op) {
+                case JournalRecord::DELETE: tree.remove(node); break;
+                case JournalRecord::MOVE: { // text is the destination path
+                    NodeId target;
+                    string name;
+                    if (splitPath(dir, r.text, target, name)) moveTo(node, target, name);
+                    break;
+                }
+                case JournalRecord::WRITE: file.write_to_file(r.text, out()); break;
+                case JournalRecord::WRITE_AT: file.write_at(r.a, r.text, out()); break;
+                case JournalRecord::MOVE_WITHIN: file.move_within_file(r.a, r.b, r.c, out()); break;
+                case JournalRecord::TRUNCATE: file.truncate_file(r.a, out()); break;
+                default: break;
+            }
+            if (r.op != JournalRecord::DELETE && r.op != JournalRecord::MOVE) tree.resized(node);
         }
-        
-    
-    
-        void showHelp() {
-            cout << "Available Commands:\n";
-            for (const auto& entry : helpMap) {
-                cout << entry.second << endl;
+
+        // Move a file to dir/leaf, replacing a file already there. The node keeps its id and content.
+        void moveTo(NodeId node, NodeId dir, const string& leaf) {
+            NodeId existing = childOf(dir, leaf);
+            if (existing == node) return;
+            if (existing != NO_NODE) tree.remove(existing);
+            tree.moveNode(node, dir, leaf);
+        }
+
+        // NodeArena::resolve(), loading the directories along the path first if the tree was opened
+        // lazily. A path that resolves as it is was loaded already: a node is only indexed once its
+        // parent is expanded. In shared mode a file found without dirOnly may be gone by the time the
+        // caller looks at it; commands look files up in a directory they hold instead (see fileAt).
+        NodeId resolve(NodeId base, const string& path, bool dirOnly = false) {
+            NodeId node = tree.resolve(base, path, dirOnly);
+            if (node != NO_NODE || !tree.hasStubs()) return node;
+            node = !path.empty() && path[0] == '/' ? NodeArena::ROOT : base;
+            vector<string> parts; // Folded the way NodeArena::resolve folds them
+            stringstream in(path);
+            string part;
+            while (getline(in, part, '/')) {
+                if (part.empty() || part == ".") continue;
+                if (part != "..") parts.push_back(part);
+                else if (!parts.empty()) parts.pop_back();
+                else if (tree.parent(node) != NO_NODE) node = tree.parent(node);
             }
+            for (const string& p : parts) {
+                node = childOf(node, p);
+                if (node == NO_NODE) return NO_NODE;
+            }
+            return dirOnly && !tree.isDir(node) ? NO_NODE : node;
         }
-    
-        // Function to show specific help
-        void showSpecificHelp(const string& command) {
-            for (const auto& entry : helpMap) {
-                if (entry.first == command) {
-                    cout << entry.second << endl;
-                    return;
+
+        // Child of dir called name, or NO_NODE; loads dir's entries first if it is a stub
+        NodeId childOf(NodeId dir, const string& name) {
+            tree.expand(dir, out());
+            return tree.child(dir, name);
+        }
+
+        // File at path (relative to the current directory unless it starts with '/') with its directory
+        // locked into lock, exclusively to change the directory's entries. NO_NODE, with nothing locked,
+        // if there is none.
+        NodeId fileAt(const string& path, bool exclusive, Lock& lock) {
+            if (!sharing) { // Nothing to lock: one lookup for the whole path
+                NodeId node = resolve(cwd(), path);
+                return node != NO_NODE && !tree.isDir(node) ? node : NO_NODE;
+            }
+            NodeId dir;
+            string leaf;
+            if (!splitPath(cwd(), path, dir, leaf)) return NO_NODE;
+            lock = lockDir(dir, exclusive);
+            NodeId node = childOf(dir, leaf);
+            if (node != NO_NODE && !tree.isDir(node)) return node;
+            lock = Lock();
+            return NO_NODE;
+        }
+
+        // Split path into the directory it names an entry in and the entry's name. Fails if that
+        // directory doesn't exist or the last component isn't a usable name.
+        bool splitPath(NodeId base, const string& path, NodeId& dir, string& leaf) {
+            size_t end = path.find_last_not_of('/');
+            if (end == string::npos) return false; // "" or "/"
+            size_t slash = path.rfind('/', end);
+            size_t begin = slash == string::npos ? 0 : slash + 1;
+            leaf = path.substr(begin, end - begin + 1);
+            if (leaf == "." || leaf == "..") return false;
+            dir = slash == string::npos ? base : resolve(base, slash == 0 ? "/" : path.substr(0, slash), true);
+            return dir != NO_NODE;
+        }
+
+        // After a failed lookup, hint at the closest existing file (or directory) for the last component
+        // of path. If the containing directory is itself missing, hint at that instead. Locks the
+        // directory it looks into, so callers hold none.
+        void suggestPath(const string& path, bool wantDir) {
+            NodeId dir;
+            string leaf;
+            size_t end = path.find_last_not_of('/');
+            if (end == string::npos) return;
+            size_t slash = path.rfind('/', end);
+            if (!splitPath(cwd(), path, dir, leaf)) {
+                if (slash != string::npos && slash > 0) suggestPath(path.substr(0, slash), true);
+                return;
+            }
+            tree.expand(dir, out());
+            Lock lock = lockDir(dir, false);
+            lock_guard<mutex> guard(suggesterLock); // Sessions share the suggester's index
+            NodeId match = suggester.closest(tree, dir, leaf, wantDir);
+            if (match != NO_NODE) out() << "Did you mean: '" << path.substr(0, slash + 1) << tree.name(match) << "'?\n";
+        }
+
+        // Visit every entry below dir on the search pool. visit(node, out) runs on a worker and appends
+        // what it wants printed to out; each worker writes its output in whole lines, so results stream
+        // as they are found without interleaving. Directories fan out into one work item per child.
+        template <typename Visit>
+        void parallelWalk(NodeId dir, Visit visit) {
+            WorkStealingPool& workers = threadPool();
+            ostream& stream = out(); // Workers are outside the session
+            WorkStealingPool::Job job = [&](size_t worker, uint32_t node) {
+                if (tree.isDir(node)) tree.forEachChild(node, [&](NodeId c) { workers.push(worker, c); });
+                string out;
+                visit(node, out);
+                if (!out.empty()) {
+                    lock_guard<mutex> guard(searchOutput);
+                    stream << out;
                 }
+            };
+            vector<uint32_t> seeds;
+            tree.forEachChild(dir, [&](NodeId c) { seeds.push_back(c); });
+            workers.run(seeds, job);
+        }
+
+        WorkStealingPool& threadPool() {
+            if (!pool) pool = make_unique<WorkStealingPool>(threads);
+            return *pool;
+        }
+
+        // Directory at path for a search, reporting it if there is none
+        NodeId searchRoot(const string& dirPath, const string& pattern) {
+            NodeId dir = resolve(cwd(), dirPath, true);
+            if (dir == NO_NODE) {
+                error() << "Directory not found.\n";
+                suggestPath(dirPath, true);
+                return NO_NODE;
+            }
+            if (pattern.empty()) {
+                error() << "Error: Search pattern cannot be empty.\n";
+                return NO_NODE;
+            }
+            tree.expandAll(dir, out()); // Workers only read the tree
+            return dir;
+        }
+
+        // Stamp a file as used by the current command
+        void touch(NodeId node) {
+            lock_guard<mutex> guard(ledger);
+            tree.file(node).lastAccess = accessClock;
+            if (compressIdle || compressSize) recentFiles.emplace_back(node, accessClock);
+            if (memoryBudget) residentFiles.emplace_back(node, accessClock);
+        }
+
+        // True if an entry of recentFiles still describes the last access of a live file
+        bool isLastAccess(NodeId node, uint64_t clock) const {
+            return node < tree.capacity() && tree.isLive(node) && !tree.isDir(node) && tree.file(node).lastAccess == clock;
+        }
+
+        // Journal a content edit of a file node, whose directory and file the caller holds
+        // Every successful content edit ends up here, so this is also where the directory totals catch up
+        void recordEdit(JournalRecord::Op op, NodeId node, const string& text = "", int64_t a = 0, int64_t b = 0, int64_t c = 0) {
+            tree.resized(node);
+            record({op, tree.components(tree.parent(node)), tree.name(node), text, a, b, c});
+        }
+
+    public:
+    FileSystem() { enterDir(NodeArena::ROOT); }
+        ~FileSystem() { finishCheckpoint(true); } // A running checkpoint thread must not outlive us
+
+        // Run this thread's commands in session s (nullptr: the shell's) until it enters another
+        static void enterSession(Session* s) { active = s; }
+
+        // Close the descriptors of the current session, which is going away
+        void endSession() {
+            Lock lock = lockTree(false);
+            vector<Handle>& handles = session().handles;
+            for (size_t i = 0; i < handles.size(); i++) {
+                if (handles[i].node != NO_NODE) releaseHandle(i);
+            }
+        }
+
+        // Command status, for batch mode: clear before a command, check after it
+        void resetStatus() { session().failed = session().unsynced = false; }
+        bool commandFailed() { return session().failed; }
+        void markFailed() { session().failed = true; }
+        ostream& output() { return out(); }
+        bool hostPathsAllowed() { return session().hostPaths; }
+
+        // Wait for the group commit that covers the current command's journal records; the command fails
+        // if they never reach disk. Sessions waiting together share one fsync.
+        void syncCommand() {
+            if (!session().unsynced) return;
+            session().unsynced = false;
+            if (!journal.sync()) journalFailed();
+        }
+    
+        // Function to display the current path (excluding root)
+        void displayPath() {
+            vector<string> parts = tree.components(cwd());
+            for (size_t i = 0; i < parts.size(); ++i) {
+                if (i > 0) out() << ">";
+                out() << parts[i];
             }
-            cout << "Unknown command. Use 'help' to see the list of available commands.\n";
+            out() << "> ";
         }
         
     
+    
         void createFile(const string& filename) {
-            if (currentDir->files.find(filename) == currentDir->files.end()) {
-                currentDir->files[filename] = File(filename); // Create a new file in the current directory
-                cout << "File created: " << filename << endl;
+            NodeId dir;
+            string name;
+            if (!splitPath(cwd(), filename, dir, name)) {
+                error() << "Directory not found.\n"; // Parent directory in the path doesn't exist
+                suggestPath(filename, false);
+                return;
+            }
+            Lock lock = lockDir(dir, true);
+            NodeId existing = childOf(dir, name);
+            if (existing == NO_NODE) {
+                tree.addFile(dir, name); // Create a new file in the target directory
+                record({JournalRecord::CREATE, tree.components(dir), name});
+                out() << "File created: " << filename << '\n';
+            } else if (tree.isDir(existing)) {
+                error() << "A directory with that name already exists.\n"; // Files and directories share one namespace
             } else {
-                cout << "File already exists.\n"; // File with the same name already exists
+                error() << "File already exists.\n"; // File with the same name already exists
             }
         }
     
         void deleteFile(const string& filename) {
-            if (currentDir->files.erase(filename)) {
-                cout << "File deleted: " << filename << endl; // Delete the file if it exists
+            Lock lock;
+            NodeId node = fileAt(filename, true, lock);
+            if (node != NO_NODE && tree.file(node).descriptors > 0) {
+                uint32_t open = tree.file(node).descriptors;
+                error() << "File is open on " << open << (open == 1 ? " descriptor" : " descriptors") << "; close it first.\n";
+            } else if (node != NO_NODE) {
+                record({JournalRecord::DELETE, tree.components(tree.parent(node)), tree.name(node)});
+                tree.remove(node);
+                out() << "File deleted: " << filename << '\n'; // Delete the file if it exists
             } else {
-                cout << "File not found.\n"; // File not found in the current directory
+                error() << "File not found.\n"; // File not found
+                suggestPath(filename, false);
             }
         }
     
         void mkdir(const string& dname) {
             if (dname.empty()) {
-                cout << "Directory name cannot be empty.\n";
+                error() << "Directory name cannot be empty.\n";
+                return;
+            }
+            NodeId dir;
+            string name;
+            if (!splitPath(cwd(), dname, dir, name)) {
+                error() << "Directory not found.\n"; // Parent directory in the path doesn't exist
+                suggestPath(dname, true);
                 return;
             }
-            if (dname == "root") {
-                cout << "Cannot create another 'root' directory.\n";
+            if (name == "root") {
+                error() << "Cannot create another 'root' directory.\n";
                 return;
             }
-            if (currentDir->subdirectories.find(dname) != currentDir->subdirectories.end()) {
-                cout << "Directory already exists.\n";
+            Lock lock = lockDir(dir, true);
+            NodeId existing = childOf(dir, name);
+            if (existing != NO_NODE) {
+                error() << (tree.isDir(existing) ? "Directory already exists.\n" : "A file with that name already exists.\n");
                 return;
             }
-            Directory newDir;
-            newDir.name = dname;
-            newDir.parent = currentDir;
-            currentDir->subdirectories[dname] = newDir;
-            cout << "Directory created: " << dname << endl;
+            // Journaled first: the new directory is not under our lock, so another session may
+            // journal something in it as soon as it is there
+            record({JournalRecord::MKDIR, tree.components(dir), name});
+            tree.addDir(dir, name);
+            out() << "Directory created: " << dname << '\n';
         }
         
     
         void chDir(const string& dirname) {
-            if (dirname == "..") {
-                if (currentDir->parent != nullptr) {
-                    currentDir = currentDir->parent;  // Move to the parent directory
-                    path.pop_back();  // Remove the last directory from the path
-                } else {
-                    cout << "Already at root directory.\n";  // Already at the root directory
-                }
-            } else if (currentDir->subdirectories.find(dirname) != currentDir->subdirectories.end()) {
-                currentDir = &currentDir->subdirectories[dirname];  // Change to the specified subdirectory
-                path.push_back(dirname);  // Add the subdirectory name to the path
+            if (dirname == ".." && cwd() == NodeArena::ROOT) {
+                error() << "Already at root directory.\n";  // Already at the root directory
+                return;
+            }
+            NodeId target = resolve(cwd(), dirname, true);
+            if (target != NO_NODE) {
+                enterDir(target);  // Change to the specified directory
             } else {
-                cout << "Directory not found.\n";  // Subdirectory not found
+                error() << "Directory not found.\n";  // Directory not found
+                suggestPath(dirname, true);
             }
         }
         
         void listFiles() {
-            if (currentDir->files.empty() && currentDir->subdirectories.empty()) {
-                cout << "Directory is empty.\n";
+            tree.expand(cwd(), out());
+            Lock lock = lockDir(cwd(), false);
+            if (!tree.hasChildren(cwd())) {
+                out() << "Directory is empty.\n";
             } else {
-                cout << "\nContents of directory '" << currentDir->name << "':\n";
+                out() << "\nContents of directory '" << tree.name(cwd()) << "':\n";
         
-                // List subdirectories
-                for (const auto& dirEntry : currentDir->subdirectories) {
-                    cout << "📁  " << dirEntry.second.name << endl;
+                // List subdirectories, with what is under them
+                for (NodeId d : tree.subdirectories(cwd())) {
+                    Totals t = tree.totals(d);
+                    out() << "📁  " << tree.name(d) << "  (" << t.bytes << " B, " << t.files << " files)\n";
                 }
         
                 // List files
-                for (const auto& fileEntry : currentDir->files) {
-                    cout << "📄  " << fileEntry.second.name << endl;
+                for (NodeId f : tree.files(cwd())) {
+                    out() << "📄  " << tree.name(f) << "  (" << tree.totals(f).bytes << " B)\n";
                 }
             }
         }
         
     
+        // Rename a file, or move it into another directory (target is a directory or a new path)
         void moveFile(const string& source, const string& target) {
-            if (currentDir->files.find(source) != currentDir->files.end()) {
-                File f = currentDir->files[source]; // Get the source file
-                f.name = target; // Rename the file
-                currentDir->files[target] = f; // Add the renamed file to the map
-                currentDir->files.erase(source); // Remove the original file
-                cout << "Moved file: " << source << " -> " << target << endl;
-            } else {
-                cout << "Source file not found.\n"; // Source file not found
+            // Both directories are found first, then locked together
+            NodeId from = NO_NODE;
+            string leaf;
+            bool sourceFound = splitPath(cwd(), source, from, leaf);
+            NodeId dir = resolve(cwd(), target, true);
+            string name = leaf;
+            bool targetFound = dir != NO_NODE || splitPath(cwd(), target, dir, name);
+            auto locks = lockDirs(sourceFound ? from : NO_NODE, dir);
+            NodeId node = sourceFound ? childOf(from, leaf) : NO_NODE;
+            if (node == NO_NODE || tree.isDir(node)) {
+                locks = {};
+                error() << "Source file not found.\n"; // Source file not found
+                suggestPath(source, false);
+                return;
+            }
+            if (!targetFound) {
+                locks = {};
+                error() << "Target directory not found.\n";
+                suggestPath(target, true);
+                return;
+            }
+            NodeId existing = childOf(dir, name);
+            if (existing != NO_NODE && tree.isDir(existing)) {
+                error() << "A directory with that name already exists.\n";
+                return;
+            }
+            if (existing != NO_NODE && existing != node && tree.file(existing).descriptors > 0) {
+                error() << "Target file is open; close it first.\n"; // Moving over it would delete it
+                return;
             }
+            JournalRecord r{JournalRecord::MOVE, tree.components(tree.parent(node)), tree.name(node)};
+            moveTo(node, dir, name); // Relink the node, the content is not copied
+            r.text = tree.pathOf(node);
+            record(r);
+            out() << "Moved file: " << source << " -> " << target << '\n';
         }
     
-        File* openFile(const string& filename) {
-            if (currentDir->files.find(filename) != currentDir->files.end()) {
-                File* file = &currentDir->files[filename];
-                if (file->is_open) {
-                    cout << "Error: File is already open.\n";
-                } else {
-                    file->is_open = true;
-                }
-                return file; // Return a pointer to the file
-            } else {
-                cout << "File not found.\n"; // File not found
+        // Copy a file, or with recursive a directory and everything below it. The target is an existing
+        // directory to copy into, or a new path. Contents are shared until either side is written.
+        void copyPath(const string& source, const string& target, bool recursive) {
+            // Both directories are found first, then locked together. A directory source is taken as it is
+            // found: it is only copied with the tree to ourselves (cp -r, see CommandSpec::access).
+            NodeId node = resolve(cwd(), source, true), from = NO_NODE;
+            string leaf;
+            if (node == NO_NODE) splitPath(cwd(), source, from, leaf);
+            NodeId dir = resolve(cwd(), target, true);
+            string name = node != NO_NODE ? tree.name(node) : leaf;
+            bool targetFound = dir != NO_NODE || splitPath(cwd(), target, dir, name);
+            auto locks = lockDirs(from, dir);
+            if (node == NO_NODE && from != NO_NODE) node = childOf(from, leaf);
+            if (node == NO_NODE || node == NodeArena::ROOT) {
+                locks = {};
+                error() << "Source not found.\n";
+                if (node == NO_NODE) suggestPath(source, false);
+                return;
+            }
+            if (tree.isDir(node) && !recursive) {
+                error() << "Source is a directory (use cp -r).\n";
+                return;
+            }
+            if (!targetFound) {
+                locks = {};
+                error() << "Target directory not found.\n";
+                suggestPath(target, true);
+                return;
+            }
+            if (tree.isDir(node) && tree.isWithin(dir, node)) {
+                error() << "Cannot copy a directory into itself.\n";
+                return;
+            }
+            NodeId existing = childOf(dir, name);
+            if (existing == node) {
+                error() << "Source and target are the same.\n";
+                return;
+            }
+            if (existing != NO_NODE && (tree.isDir(existing) || tree.isDir(node))) {
+                error() << (tree.isDir(existing) ? "A directory" : "A file") << " with that name already exists.\n";
+                return;
+            }
+            if (existing != NO_NODE && tree.file(existing).descriptors > 0) {
+                error() << "Target file is open; close it first.\n";
+                return;
+            }
+            JournalRecord r{JournalRecord::COPY, tree.components(tree.parent(node)), tree.name(node)};
+            if (existing != NO_NODE) tree.remove(existing); // A file replaces a file, as with move
+            NodeId copy = tree.copyNode(node, dir, tree.intern(name));
+            r.text = tree.pathOf(copy);
+            record(r);
+            out() << "Copied: " << source << " -> " << target << '\n';
+        }
+
+        // Parse "#<n>" into a slot of the handle table; false if arg is not written as a descriptor
+        static bool isDescriptor(const string& arg, size_t& slot) {
+            if (arg.size() < 2 || arg[0] != '#' || arg.find_first_not_of("0123456789", 1) != string::npos || arg.size() > 10) return false;
+            slot = stoul(arg.substr(1)) - 1;
+            return true;
+        }
+
+        // Open handle in slot with the access need, its file's directory locked into dir, or nullptr after
+        // reporting why there is none
+        Handle* handleAt(size_t slot, uint8_t need, Lock& dir) {
+            vector<Handle>& handles = session().handles;
+            if (slot >= handles.size() || handles[slot].node == NO_NODE) {
+                error() << "Bad descriptor.\n";
+                return nullptr;
+            }
+            Handle& h = handles[slot];
+            if (!lockParent(h.node, h.serial, false, dir)) {
+                error() << "Bad descriptor: the file is gone with the tree it was opened in.\n";
+                h = Handle();
+                return nullptr;
+            }
+            if ((h.mode & need) != need) {
+                error() << "Descriptor not open for " << (need & WRITE ? "writing" : "reading") << ".\n";
                 return nullptr;
             }
+            return &h;
+        }
+
+        // File a data command works on: "#<n>" is an open descriptor, used without looking up any name;
+        // anything else is a path. need is the access required of a descriptor. The file's directory is
+        // locked into dir (shared) for the rest of the command. Reports the failure and returns NO_NODE.
+        NodeId target(const string& arg, uint8_t need, Handle*& handle, Lock& dir) {
+            size_t slot;
+            handle = nullptr;
+            NodeId node;
+            if (isDescriptor(arg, slot)) {
+                handle = handleAt(slot, need, dir);
+                if (!handle) return NO_NODE;
+                node = handle->node;
+            } else {
+                node = fileAt(arg, false, dir);
+                if (node == NO_NODE) {
+                    error() << "File not found.\n"; // File not found
+                    suggestPath(arg, false);
+                    return NO_NODE;
+                }
+            }
+            touch(node);
+            return node;
+        }
+
+        // Make dir the current directory of the session
+        void enterDir(NodeId dir) {
+            session().currentDir = dir;
+            session().dirSerial = tree.serial(dir);
+        }
+
+        // Close a descriptor. The file it was opened on may be gone with a tree replaced since.
+        void releaseHandle(size_t slot) {
+            Handle& h = session().handles[slot];
+            Lock dir;
+            if (lockParent(h.node, h.serial, false, dir)) {
+                lock_guard<mutex> guard(ledger);
+                tree.file(h.node).descriptors--;
+            }
+            h = Handle();
+        }
+
+        // Open a file with mode r, w, rw or a (append) and return its descriptor, or 0 on failure
+        size_t openFile(const string& filename, const string& mode = "") {
+            uint8_t bits = mode.empty() || mode == "rw" ? READ | WRITE : mode == "r" ? READ : mode == "w" ? WRITE : mode == "a" ? WRITE | APPEND : 0;
+            if (!bits) {
+                error() << "Unknown mode '" << mode << "' (use r, w, rw or a).\n";
+                return 0;
+            }
+            Lock dir;
+            NodeId node = fileAt(filename, false, dir);
+            if (node == NO_NODE) {
+                error() << "File not found.\n"; // File not found
+                suggestPath(filename, false);
+                return 0;
+            }
+            vector<Handle>& handles = session().handles;
+            size_t slot = find_if(handles.begin(), handles.end(), [](const Handle& h) { return h.node == NO_NODE; }) - handles.begin();
+            if (slot == handles.size()) handles.emplace_back();
+            Lock lock = lockFile(node, false);
+            File& file = tree.file(node);
+            handles[slot] = {node, tree.serial(node), bits, bits & APPEND ? file.size() : 0};
+            touch(node);
+            {
+                lock_guard<mutex> guard(ledger);
+                file.descriptors++;
+            }
+            out() << "Opened " << filename << " as #" << slot + 1 << '\n';
+            return slot + 1;
+        }
+
+        // Move a descriptor's cursor; reads and writes through it continue from there
+        void seek(const string& fd, int pos) {
+            size_t slot;
+            Lock dir;
+            Handle* h = isDescriptor(fd, slot) ? handleAt(slot, 0, dir) : nullptr;
+            if (!h) {
+                if (!session().failed) error() << "Bad descriptor.\n";
+                return;
+            }
+            if (pos < 0) {
+                error() << "Error: Position cannot be negative.\n";
+                return;
+            }
+            h->cursor = pos;
+        }
+
+        // Open descriptors with their file, mode and cursor
+        void listHandles() {
+            const vector<Handle>& handles = session().handles;
+            bool any = false;
+            for (size_t i = 0; i < handles.size(); i++) {
+                const Handle& h = handles[i];
+                if (h.node == NO_NODE) continue;
+                any = true;
+                out() << '#' << i + 1 << "  ";
+                Lock dir;
+                if (!lockParent(h.node, h.serial, false, dir)) {
+                    out() << "(deleted)\n";
+                    continue;
+                }
+                Lock lock = lockFile(h.node, false);
+                out() << tree.pathOf(h.node) << "  " << (h.mode & READ ? "r" : "") << (h.mode & APPEND ? "a" : h.mode & WRITE ? "w" : "")
+                     << "  at " << h.cursor << " of " << tree.file(h.node).size() << " B\n";
+            }
+            if (!any) out() << "No open descriptors.\n";
         }
     
+        // Content edits. Each takes a path or a descriptor and is journaled when it succeeds. Through a
+        // descriptor, write goes to the cursor (or the end, in append mode) and moves it past the text;
+        // write_at, move_within and truncate work at the positions they are given.
+        void writeFile(const string& filename, const string& text) {
+            Handle* h;
+            Lock dir;
+            NodeId node = target(filename, WRITE, h, dir);
+            if (node == NO_NODE) return;
+            Lock lock = lockFile(node, true);
+            File& file = tree.file(node);
+            if (!h || h->mode & APPEND) {
+                file.write_to_file(text, out());
+                recordEdit(JournalRecord::WRITE, node, text);
+                if (h) h->cursor = file.size();
+            } else if (h->cursor > INT_MAX) {
+                error() << "Error: The cursor is past the largest position a write can start at.\n"; // write_at takes an int
+            } else if (file.write_at(int(h->cursor), text, out())) {
+                recordEdit(JournalRecord::WRITE_AT, node, text, h->cursor);
+                h->cursor += text.size();
+            } else {
+                session().failed = true;
+            }
+        }
+
+        void writeAt(const string& filename, int pos, const string& text) {
+            Handle* h;
+            Lock dir;
+            NodeId node = target(filename, WRITE, h, dir);
+            if (node == NO_NODE) return;
+            Lock lock = lockFile(node, true);
+            if (tree.file(node).write_at(pos, text, out())) {
+                recordEdit(JournalRecord::WRITE_AT, node, text, pos);
+            } else {
+                session().failed = true;
+            }
+        }
+
+        void moveWithin(const string& filename, int start, int size, int target) {
+            Handle* h;
+            Lock dir;
+            NodeId node = this->target(filename, WRITE, h, dir);
+            if (node == NO_NODE) return;
+            Lock lock = lockFile(node, true);
+            if (tree.file(node).move_within_file(start, size, target, out())) {
+                recordEdit(JournalRecord::MOVE_WITHIN, node, "", start, size, target);
+            } else {
+                session().failed = true;
+            }
+        }
+
+        void truncateFile(const string& filename, int size) {
+            Handle* h;
+            Lock dir;
+            NodeId node = target(filename, WRITE, h, dir);
+            if (node == NO_NODE) return;
+            Lock lock = lockFile(node, true);
+            if (tree.file(node).truncate_file(size, out())) {
+                recordEdit(JournalRecord::TRUNCATE, node, "", size);
+            } else if (size < 0) {
+                session().failed = true; // Truncating to a larger size is only a warning
+            }
+        }
+
+        // Print a file, or up to size bytes of it, straight from its pieces. Through a descriptor the
+        // read starts at the cursor and moves it past what was printed; at the end it prints nothing.
+        void readFile(const string& filename, int size = -1) {
+            Handle* h;
+            Lock dir;
+            NodeId node = target(filename, READ, h, dir);
+            if (node == NO_NODE) return;
+            Lock lock = lockForRead(node);
+            File& file = tree.file(node);
+            size_t length = file.size();
+            size_t start = h ? min(h->cursor, length) : 0;
+            size_t count = size < 0 ? length - start : min<size_t>(size, length - start);
+            if (start == 0 && count == length) file.print(out());
+            else if (count > 0) file.print(out(), start, count);
+            out() << '\n';
+            if (h) h->cursor = start + count;
+        }
+
+        // Print part of a file at a given position; a descriptor's cursor doesn't move
+        void readFrom(const string& filename, int start, int size) {
+            Handle* h;
+            Lock dir;
+            NodeId node = target(filename, READ, h, dir);
+            if (node == NO_NODE) return;
+            Lock lock = lockForRead(node);
+            File& file = tree.file(node);
+            if (start < 0 || (size_t)start >= file.size()) session().failed = true; // read_from reports it
+            file.print(out(), start, size);
+            out() << '\n';
+        }
+
+        // Replace the content of file (created if missing) with the bytes of a host file, binary or not.
+        // The host file is mapped and fed to the chunker a window at a time; each window's pages are
+        // dropped once it is cut, so only the distinct blocks stay in memory, never a second copy of
+        // the whole file. Each window is journaled as it goes and synced before the next one, so the
+        // journal never buffers more than a window either; a crash part way leaves the file holding
+        // the windows already synced, as an interrupted copy would.
+        void importFile(const string& hostPath, const string& filename) {
+            struct stat st;
+            if (stat(hostPath.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+                error() << "Host file not found: " << hostPath << '\n';
+                return;
+            }
+            NodeId dir;
+            string name;
+            if (!splitPath(cwd(), filename, dir, name)) {
+                error() << "Directory not found.\n";
+                suggestPath(filename, false);
+                return;
+            }
+            Lock lock = lockDir(dir, true);
+            NodeId node = childOf(dir, name);
+            if (node != NO_NODE && tree.isDir(node)) {
+                error() << "A directory with that name already exists.\n";
+                return;
+            }
+            MappedFile host(hostPath);
+            if (st.st_size > 0 && !host.ok()) {
+                error() << "Cannot read " << hostPath << ".\n";
+                return;
+            }
+
+            // Appended straight to the journal: no checkpoint may come between the records of one import
+            bool journaled = journal.isOpen(), durable = true;
+            if (journaled && node == NO_NODE) durable = journal.append({JournalRecord::CREATE, tree.components(dir), name});
+            if (journaled && node != NO_NODE && tree.totals(node).bytes > 0) {
+                durable = journal.append({JournalRecord::TRUNCATE, tree.components(dir), name, "", 0});
+            }
+            Rope content;
+            if (st.st_size > 0) {
+                BlockStore& store = BlockStore::instance();
+                Chunker chunker;
+                string pending;
+                auto chunk = [&](string_view c) { content.appendShared(store.intern(c)); };
+                host.advise(MADV_SEQUENTIAL);
+                for (size_t at = 0; at < host.size(); at += IMPORT_WINDOW) {
+                    size_t length = min(IMPORT_WINDOW, host.size() - at);
+                    string_view window(host.data() + at, length);
+                    if (journaled && durable) {
+                        durable = journal.append({JournalRecord::WRITE, tree.components(dir), name, string(window)}) && journal.sync();
+                    }
+                    chunker.feed(window, pending, chunk);
+                    host.advise(MADV_DONTNEED, at, length); // Whatever the chunker still needs is in pending
+                }
+                if (!pending.empty()) chunk(string_view(pending));
+            }
+
+            if (node == NO_NODE) node = tree.addFile(dir, name);
+            File& file = tree.file(node);
+            file.content = move(content);
+            file.packed.reset();
+            file.stored.reset();
+            tree.resized(node);
+            touch(node);
+            if (journaled && !durable) journalFailed();
+            if (journaled) checkpointIfLarge();
+            out() << "Imported " << file.size() << " B: " << hostPath << " -> " << filename << '\n';
+        }
+
+        // Write a file's content to a host file. Pieces are gathered straight from the rope buffers, or
+        // from the snapshot mapping for a file not loaded yet, into writev() calls: nothing is copied
+        // in between and the file is not warmed up (a compressed one is decoded into a temporary, a spilled
+        // one read back through the page cache).
+        void exportFile(const string& filename, const string& hostPath) {
+            Handle* h;
+            Lock dir;
+            NodeId node = target(filename, READ, h, dir);
+            if (node == NO_NODE) return;
+            Lock lock = lockFile(node, false); // Exported without thawing
+            int fd = ::open(hostPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                error() << "Cannot write " << hostPath << ".\n";
+                return;
+            }
+            const File& file = tree.file(node);
+            vector<iovec> batch;
+            bool ok = true;
+            auto flush = [&] {
+                iovec* next = batch.data();
+                size_t left = batch.size();
+                while (ok && left > 0) {
+                    ssize_t n = writev(fd, next, min<size_t>(left, IOV_MAX));
+                    if (n <= 0) {
+                        ok = false;
+                        break;
+                    }
+                    for (size_t done = n; done > 0;) { // Skip what was written, resuming inside a piece if need be
+                        size_t step = min(done, next->iov_len);
+                        next->iov_base = static_cast<char*>(next->iov_base) + step;
+                        next->iov_len -= step;
+                        done -= step;
+                        if (next->iov_len == 0) {
+                            next++;
+                            left--;
+                        }
+                    }
+                }
+                batch.clear();
+            };
+            // Rope buffers and a snapshot mapping outlive the walk, so their pieces are gathered as they are.
+            // A decoded or paged-in piece is gone once the visit returns: large ones are written on the
+            // spot, small ones (spilled pages) copied and written IMPORT_WINDOW bytes at a time.
+            bool transient = file.compressed() || dynamic_cast<const SpilledContent*>(file.stored.get());
+            string copied;
+            auto flushCopied = [&] {
+                if (copied.empty()) return;
+                batch.push_back({copied.data(), copied.size()});
+                flush();
+                copied.clear();
+            };
+            file.forEachPiece(0, file.size(), [&](string_view piece) {
+                if (piece.empty()) return;
+                if (transient && piece.size() < IMPORT_WINDOW) {
+                    copied.append(piece);
+                    if (copied.size() >= IMPORT_WINDOW) flushCopied();
+                    return;
+                }
+                flushCopied();
+                batch.push_back({const_cast<char*>(piece.data()), piece.size()});
+                if (batch.size() == EXPORT_BATCH || transient) flush();
+            }, out());
+            flushCopied();
+            flush();
+            if (::close(fd) != 0) ok = false;
+            if (!ok) {
+                error() << "Failed to write " << hostPath << ".\n";
+                return;
+            }
+            out() << "Exported " << file.size() << " B: " << filename << " -> " << hostPath << '\n';
+        }
+
+        // Close a descriptor, or given a path every descriptor of that file
         void closeFile(const string& filename) {
-            if (currentDir->files.find(filename) != currentDir->files.end()) {
-                currentDir->files[filename].is_open = false; // Mark the file as closed
-                cout << "File closed.\n";
+            vector<Handle>& handles = session().handles;
+            size_t slot;
+            if (isDescriptor(filename, slot)) {
+                if (slot < handles.size() && handles[slot].node != NO_NODE) {
+                    releaseHandle(slot);
+                    out() << "File closed.\n";
+                } else {
+                    error() << "Bad descriptor.\n";
+                }
+                return;
+            }
+            Lock dir;
+            NodeId node = fileAt(filename, false, dir);
+            if (node != NO_NODE) {
+                dir = Lock(); // Each descriptor locks it again on release
+                for (size_t i = 0; i < handles.size(); i++) {
+                    if (handles[i].node == node) releaseHandle(i);
+                }
+                out() << "File closed.\n";
             } else {
-                cout << "File not found.\n"; // File not found
+                error() << "File not found.\n"; // File not found
+                suggestPath(filename, false);
             }
         }
     
-        void showMemoryMap(Directory* dir = nullptr, int depth = 0) {
-            if (dir == nullptr) dir = &root; // Start from the root directory if no directory is specified
-            for (auto& d : dir->subdirectories) {
-                for (int i = 0; i < depth; i++) cout << "  "; // Indent based on depth
-                cout << "📁 " << d.first << endl; // Print directory name
-                showMemoryMap(&d.second, depth + 1); // Recursively show subdirectories
+        // Print every occurrence of pattern in the files under dirPath as path:offset: context
+        void grep(const string& dirPath, const string& pattern) {
+            NodeId dir = searchRoot(dirPath, pattern);
+            if (dir == NO_NODE) return;
+            atomic<size_t> matches{0}, files{0};
+            ostream& stream = out();
+            parallelWalk(dir, [&](NodeId node, string& out) {
+                if (tree.isDir(node)) return;
+                ostringstream damage; // Only a compressed file can report anything, printed with the matches
+                Rope::View content = tree.file(node).view(damage); // Compressed files are decoded for the scan only
+                out += damage.str();
+                string path;
+                size_t found = 0;
+                search::forEachMatch(content, pattern, [&](size_t offset) {
+                    if (found++ == 0) path = tree.pathOf(node);
+                    size_t from = offset > SNIPPET ? offset - SNIPPET : 0;
+                    size_t to = min(content.size(), offset + pattern.size() + SNIPPET);
+                    string snippet = content.slice(from, to - from).str();
+                    replace(snippet.begin(), snippet.end(), '\n', ' '); // One line per match
+                    out += path + ":" + to_string(offset) + ": " + snippet + '\n';
+                    if (out.size() >= OUTPUT_CHUNK) { // Don't sit on the results of a large file
+                        lock_guard<mutex> guard(searchOutput);
+                        stream << out;
+                        out.clear();
+                    }
+                });
+                if (found > 0) {
+                    matches += found;
+                    files++;
+                }
+            });
+            out() << matches << " matches in " << files << " files.\n";
+        }
+
+        // Print the path of every file and directory under dirPath whose name contains pattern
+        void find(const string& dirPath, const string& pattern) {
+            NodeId dir = searchRoot(dirPath, pattern);
+            if (dir == NO_NODE) return;
+            static const search::Kernel contains = search::bestKernel();
+            atomic<size_t> found{0};
+            parallelWalk(dir, [&](NodeId node, string& out) {
+                if (contains(tree.name(node), pattern, 0) == string_view::npos) return;
+                out += tree.pathOf(node) + (tree.isDir(node) ? "/\n" : "\n");
+                found++;
+            });
+            out() << found << " entries found.\n";
+        }
+
+        // Compress files untouched for idle commands, and files of size bytes or more once a command is
+        // done with them (0 turns a rule off). Applies to the whole tree right away.
+        void setCompression(uint64_t idle, size_t size) {
+            compressIdle = idle;
+            compressSize = size;
+            if (!compressIdle && !compressSize) recentFiles.clear();
+        }
+
+        void compression(int idle, int size) {
+            if (idle < 0 || size < 0) {
+                error() << "Error: Limits cannot be negative.\n";
+                return;
+            }
+            setCompression(idle, size);
+            size_t packed = compressCold();
+            out() << "Compression " << (idle || size ? "on" : "off") << "; " << packed << " files compressed.\n";
+        }
+
+        // Compress every file the policy calls cold; returns how many were
+        size_t compressCold() {
+            if (!compressIdle && !compressSize) return 0;
+            size_t packed = 0;
+            tree.forEachFile([&](File& f) {
+                bool old = compressIdle && (f.lastAccess == 0 || accessClock - f.lastAccess >= compressIdle);
+                bool large = compressSize && f.size() >= compressSize;
+                if ((old || large) && f.compress()) {
+                    tree.recharge(f);
+                    packed++;
+                }
+            });
+            return packed;
+        }
+
+        // Called after every command: runs a checkpoint the command made due, applies the compression
+        // policy to the files it used and to those that have now gone unused for long enough, then
+        // advances the access clock
+        void endCommand() {
+            finishCheckpoint(false);
+            if (checkpointDue.exchange(false)) checkpoint(false);
+            if (compressSize) {
+                for (auto it = recentFiles.rbegin(); it != recentFiles.rend() && it->second == accessClock; ++it) {
+                    File& f = tree.file(it->first);
+                    if (isLastAccess(it->first, it->second) && f.size() >= compressSize && f.compress()) tree.recharge(f);
+                }
+            }
+            while (!recentFiles.empty() && (!compressIdle || accessClock - recentFiles.front().second >= compressIdle)) {
+                auto [node, clock] = recentFiles.front();
+                if (clock == accessClock) break; // Used by this command, only the size rule applies
+                recentFiles.pop_front();
+                if (compressIdle && isLastAccess(node, clock) && tree.file(node).compress()) tree.recharge(tree.file(node));
+            }
+            if (memoryBudget) enforceBudget();
+            accessClock++;
+        }
+
+        // endCommand() for shared mode, called by each session after a command, holding no lock.
+        // Compression, spilling and checkpoints rewrite files other sessions may be using, so they run
+        // with the tree to themselves once every MAINTENANCE_INTERVAL commands over all sessions. The
+        // access clock then counts these rounds rather than commands.
+        void endSharedCommand() {
+            if (++sharedCommands % MAINTENANCE_INTERVAL && !checkpointDue) return;
+            unique_lock<shared_mutex> guard(treeLock);
+            endCommand();
+        }
+
+        // Let several sessions run commands at once, each in its own thread (see enterSession). A lazily
+        // opened tree is loaded in full first: loading a directory changes the tree.
+        void setShared() {
+            tree.expandAll(NodeArena::ROOT, out());
+            tree.setConcurrent(true);
+            dirLocks = make_unique<shared_mutex[]>(DIR_LOCKS);
+            fileLocks = make_unique<shared_mutex[]>(FILE_LOCKS);
+            sharing = true;
+        }
+
+        // The tree, held in shared mode by whatever walks it outside a command; empty otherwise
+        Lock lockTree(bool exclusive) { return sharing ? take(treeLock, exclusive) : Lock(); }
+
+        // The tree, held by a command for its duration (see CommandSpec::access). A session whose
+        // current directory went away (another session replaced the tree) is put back at the root under
+        // the same lock, so the directory stays for the whole command.
+        Lock beginCommand(bool exclusive) {
+            Lock lock = lockTree(exclusive);
+            Session& s = session();
+            if (!tree.holds(s.currentDir, s.dirSerial)) enterDir(NodeArena::ROOT);
+            return lock;
+        }
+
+        // Bytes the contents in memory may take; the rest of the budget is the page cache
+        size_t residentLimit() const { return memoryBudget - memoryBudget / 8; }
+
+        // Write a file's content to the page store and drop it from memory. The store is created on first
+        // use next to the snapshot; if that fails the budget is turned off rather than failing commands.
+        bool spill(NodeId node) {
+            File& file = tree.file(node);
+            if (file.stored || !file.charged) return false;
+            if (!pages) {
+                string path = (snapshotFile.empty() ? string("fs") : snapshotFile) + ".pages";
+                pages = make_shared<PageStore>();
+                if (!pages->open(path)) {
+                    out() << "Warning: Cannot create page store " << path << ", memory budget turned off.\n";
+                    pages.reset();
+                    setMemoryBudget(0);
+                    return false;
+                }
+                pages->setCacheSize(memoryBudget - residentLimit());
             }
-            for (auto& f : dir->files) {
-                for (int i = 0; i < depth; i++) cout << "  "; // Indent based on depth
-                cout << "📄 " << f.first << endl; // Print file name
+            shared_ptr<const StoredContent> copy = pages->spill(file);
+            if (!copy) {
+                out() << "Warning: Cannot write to the page store, " << tree.pathOf(node) << " stays in memory.\n";
+                return false;
+            }
+            file.spill(move(copy));
+            tree.recharge(file);
+            return true;
+        }
+
+        // After a command: measure the files it used and spill the least recently used ones while the
+        // contents are over the budget. Files used by this command stay, even if they alone are over.
+        void enforceBudget() {
+            for (auto it = residentFiles.rbegin(); it != residentFiles.rend() && it->second == accessClock; ++it) {
+                if (isLastAccess(it->first, it->second)) tree.recharge(tree.file(it->first));
+            }
+            while (memoryBudget && tree.residentBytes() > residentLimit() && !residentFiles.empty()) {
+                auto [node, clock] = residentFiles.front();
+                if (clock == accessClock) break;
+                residentFiles.pop_front();
+                if (isLastAccess(node, clock)) spill(node);
+            }
+            if (residentFiles.size() > 2 * tree.size() + 1024) { // Mostly entries of files used again since
+                deque<pair<NodeId, uint64_t>> live;
+                for (const auto& entry : residentFiles) {
+                    if (isLastAccess(entry.first, entry.second)) live.push_back(entry);
+                }
+                residentFiles.swap(live);
+            }
+        }
+
+        // Measure every file and spill the least recently used until the contents fit the budget, then
+        // queue the rest by last use; returns how many were spilled. For loads and budget changes.
+        size_t spillCold() {
+            residentFiles.clear();
+            if (!memoryBudget) return 0;
+            tree.rechargeAll();
+            vector<pair<uint64_t, NodeId>> resident; // (last access, file)
+            for (NodeId id = 0; id < tree.capacity(); id++) {
+                if (tree.isLive(id) && !tree.isDir(id) && tree.file(id).charged) resident.emplace_back(tree.file(id).lastAccess, id);
+            }
+            sort(resident.begin(), resident.end());
+            size_t spilled = 0, i = 0;
+            for (; i < resident.size() && tree.residentBytes() > residentLimit(); i++) {
+                if (spill(resident[i].second)) spilled++;
+                if (!memoryBudget) return spilled; // The page store could not be created
+            }
+            for (; i < resident.size(); i++) residentFiles.emplace_back(resident[i].second, tree.file(resident[i].second).lastAccess);
+            return spilled;
+        }
+
+        // Keep the file contents held in memory within bytes (0 turns the budget off). Seven eighths go to
+        // contents, measured after every command; the least recently used files beyond that are spilled
+        // to a page store on disk and read back through a page cache that gets the last eighth.
+        void setMemoryBudget(size_t bytes) {
+            memoryBudget = bytes;
+            if (!memoryBudget) residentFiles.clear();
+            if (pages) pages->setCacheSize(memoryBudget - residentLimit());
+        }
+
+        void budget(long bytes) {
+            if (bytes < 0) {
+                error() << "Error: Budget cannot be negative.\n";
+                return;
+            }
+            setMemoryBudget(bytes);
+            size_t spilled = spillCold();
+            if (!memoryBudget) out() << "Memory budget off; " << tree.residentBytes() << " B of contents in memory.\n";
+            else out() << "Memory budget " << memoryBudget << " B; " << spilled << " files spilled, " << tree.residentBytes() << " B of contents in memory.\n";
+        }
+
+        // Open snapshots lazily: directories and contents are read from the snapshot as they are first used
+        void setLazyLoad(bool lazy) { lazyLoad = lazy; }
+
+        // Workers used by grep, find, saves and loads (the calling thread counts as one)
+        void setThreads(size_t count) {
+            threads = max<size_t>(1, count);
+            pool.reset();
+        }
+
+        // Tree of the whole file system with the heap bytes each node owns
+        void showMemoryMap(NodeId dir = NodeArena::ROOT, int depth = 0) {
+            if (dir == NodeArena::ROOT && depth == 0) {
+                tree.expandAll(NodeArena::ROOT, out());
+                NodeArena::MemoryStats m = tree.memoryStats();
+                out() << "Total: " << tree.size() << " nodes, " << tree.memoryUsage() << " B; " << m.compressedFiles
+                     << " files compressed, " << m.compressedRaw << " B raw in " << m.compressedBytes << " B\n";
+            }
+            for (NodeId d : tree.subdirectories(dir)) {
+                for (int i = 0; i < depth; i++) out() << "  "; // Indent based on depth
+                Totals t = tree.totals(d);
+                out() << "📁 " << tree.name(d) << " (" << t.bytes << " B in " << t.files << " files, " << t.dirs << " dirs) ["
+                     << tree.nodeMemory(d) << " B]" << '\n'; // Print directory name
+                showMemoryMap(d, depth + 1); // Recursively show subdirectories
+            }
+            for (NodeId f : tree.files(dir)) {
+                for (int i = 0; i < depth; i++) out() << "  "; // Indent based on depth
+                const File& file = tree.file(f);
+                out() << "📄 " << tree.name(f) << " (" << file.size() << " B) [" << tree.nodeMemory(f) << " B"; // Print file name
+                if (file.compressed()) out() << ", compressed " << file.size() << " -> " << file.memoryUsage() << " B";
+                else if (dynamic_cast<const SpilledContent*>(file.stored.get())) out() << ", spilled";
+                out() << "]\n";
             }
         }
     
-        // Save the file system
+        // Bytes, files and directories under a directory and under each of its subdirectories. Read from
+        // the totals every directory keeps, so nothing below the listed level is walked or loaded.
+        void diskUsage(const string& dirPath) {
+            NodeId dir = dirPath.empty() ? cwd() : resolve(cwd(), dirPath, true);
+            if (dir == NO_NODE) {
+                error() << "Directory not found.\n";
+                suggestPath(dirPath, true);
+                return;
+            }
+            tree.expand(dir, out());
+            Lock lock = lockDir(dir, false);
+            auto line = [&](NodeId d) {
+                Totals t = tree.totals(d);
+                out() << setw(12) << t.bytes << " B " << setw(8) << t.files << " files " << setw(6) << t.dirs << " dirs  "
+                     << tree.pathOf(d) << '\n';
+            };
+            for (NodeId d : tree.subdirectories(dir)) line(d);
+            line(dir);
+        }
+
+        // Rebuild every file from shared content-defined blocks and report how much that saves
+        void dedup() {
+            tree.dedupContents();
+            NodeArena::MemoryStats m = tree.memoryStats();
+            size_t saved = m.contentBytes > m.storedBytes ? m.contentBytes - m.storedBytes : 0;
+            out() << "Content: " << m.contentBytes << " B in " << m.files << " files, stored as " << m.storedBytes << " B in "
+                 << m.buffers << " unique blocks\n";
+            out() << fixed << setprecision(2) << "Dedup ratio " << (m.storedBytes ? double(m.contentBytes) / m.storedBytes : 1.0)
+                 << ":1, " << saved << " B saved (" << (m.contentBytes ? 100.0 * saved / m.contentBytes : 0.0) << "%)\n"
+                 << defaultfloat << setprecision(6);
+        }
+
+        // Node counts, memory by structure and, unless built with FS_NO_STATS, command latencies
+        void printStats(ostream& out) {
+            NodeArena::MemoryStats m = tree.memoryStats();
+            size_t dirs = max<size_t>(m.dirs, 1);
+            out << "Nodes: " << m.dirs << " directories, " << m.files << " files\n";
+            out << "Content: " << m.contentBytes << " B in " << m.pieces << " pieces, " << m.storedBytes << " B stored\n";
+            out << "Memory: nodes " << m.nodeBytes << " B, path index " << m.indexBytes << " B (" << m.indexBytes / dirs
+                << " B per directory), names " << m.nameBytes << " B, file slots and pieces " << m.blobBytes << " B, total "
+                << m.storedBytes + m.nodeBytes + m.indexBytes + m.nameBytes + m.blobBytes << " B\n";
+            if (memoryBudget || pages) printPageStats(out);
+#ifndef FS_NO_STATS
+            Stats::instance().print(out);
+#else
+            out << "Latency statistics were compiled out (FS_NO_STATS).\n";
+#endif
+        }
+
+        // Budget, page store and page cache counters
+        void printPageStats(ostream& out) {
+            out << "Memory budget: " << (memoryBudget ? to_string(memoryBudget) + " B" : string("off")) << ", contents in memory "
+                << tree.residentBytes() << " B\n";
+            if (!pages) return;
+            PageStore::Counters& c = pages->stats();
+            auto [used, total] = pages->pagesInUse();
+            uint64_t lookups = c.hits + c.misses;
+            out << "Page store: " << c.spilled << " files spilled, " << c.pagedIn << " paged back in; " << used * PageStore::PAGE
+                << " B in use of " << total * PageStore::PAGE << " B on disk\n";
+            out << "Page cache: " << pages->cachedPages() << " pages, " << c.hits << " hits, " << c.misses << " misses ("
+                << fixed << setprecision(1) << (lookups ? 100.0 * c.hits / lookups : 0.0) << defaultfloat << setprecision(6) << "% hits), "
+                << c.evictions << " evictions, " << c.readAhead << " pages read ahead\n";
+        }
+
+        // Save the file system as a binary snapshot (see Snapshot.h)
+        void saveSnapshot(const string& filename) {
+            FS_TIME_SCOPE("save_snapshot");
+            if (!Snapshot::save(tree, filename, 0, threads)) {
+                error() << "Failed to save.\n";
+            }
+        }
+
+        // Load a binary snapshot; returns false if there is none so the caller can fall back to a .dat file
+        bool loadSnapshot(const string& filename) {
+            FS_TIME_SCOPE("load_snapshot");
+            bool loaded = lazyLoad ? Snapshot::openLazy(tree, filename, journalGen, out())
+                                   : Snapshot::load(tree, filename, journalGen, out(), threads);
+            if (!loaded) return false;
+            enterDir(NodeArena::ROOT); // Reset the current directory
+            tree.rechargeAll();
+            return true;
+        }
+
+        // Load the snapshot (or import the .dat file on first run), replay the journal on top of it and
+        // start journaling. From here on every mutation is appended to the journal as it happens.
+        void openStorage(const string& snapshot, const string& datFile) {
+            snapshotFile = snapshot;
+            if (!loadSnapshot(snapshot)) {
+                loadFromFile(datFile); // First run: start from the text layout
+                journalGen = 0;
+                for (uint32_t gen = 0; remove(journalName(gen).c_str()) == 0; gen++) {} // Journals of a discarded snapshot
+                if (!Snapshot::save(tree, snapshot, journalGen, threads)) out() << "Failed to save.\n";
+            }
+            for (uint32_t gen = journalGen; gen-- > 0 && remove(journalName(gen).c_str()) == 0;) {} // Left by an interrupted checkpoint
+
+            // Replay every journal generation since the snapshot, in order
+            oldestJournal = journalGen;
+            uint64_t validBytes = Journal::replay(journalName(journalGen), [&](const JournalRecord& r) { applyRecord(r); });
+            while (ifstream(journalName(journalGen + 1)).good()) {
+                journalGen++;
+                validBytes = Journal::replay(journalName(journalGen), [&](const JournalRecord& r) { applyRecord(r); });
+            }
+            if (!journal.open(journalName(journalGen), validBytes)) {
+                out() << "Failed to open journal. Changes will only be saved on exit.\n";
+            }
+            compressCold();
+            spillCold();
+        }
+
+        // Flush the journal and wait for a running checkpoint; nothing else needs writing at exit unless
+        // the journal failed
+        void closeStorage() {
+            finishCheckpoint(true);
+            if (journal.isOpen() && journal.close()) return;
+            if (snapshotFile.empty()) return;
+            // No journal, or it failed: fall back to a full save, numbered past every generation on disk
+            if (Snapshot::save(tree, snapshotFile, journalGen + 1, threads)) {
+                for (uint32_t gen = oldestJournal; gen <= journalGen; gen++) remove(journalName(gen).c_str());
+            } else {
+                error() << "Failed to save.\n";
+            }
+        }
+
+        // Fold the journal into a new snapshot. The journal moves to a new generation right away and
+        // the snapshot is written from a copy of the tree (contents are shared, not copied), on a
+        // background thread unless wait is set. Old generations are deleted only once Snapshot::save reports
+        // the snapshot synced to disk, its rename included.
+        void checkpoint(bool wait) {
+            if (snapshotFile.empty()) return;
+            finishCheckpoint(wait);
+            if (checkpointer.joinable()) return; // One checkpoint at a time
+            uint32_t from = oldestJournal, next = journalGen + 1;
+            journal.close(); // Flushes the pending group
+            journalGen = next;
+            journal.open(journalName(journalGen), 0);
+
+            auto copy = make_shared<NodeArena>(tree); // Contents are shared ropes, so this copies nodes and names only
+            if (tree.nameCount() > 2 * tree.size() + 1024) tree.compactNames(); // Names deleted and renamed nodes left behind
+            checkpointDone = false;
+            checkpointer = thread([this, copy, from, next, workers = threads] {
+                bool ok = Snapshot::save(*copy, snapshotFile, next, workers); // Its own workers, not the shell's pool
+                if (ok) {
+                    for (uint32_t gen = from; gen < next; gen++) remove(journalName(gen).c_str());
+                }
+                checkpointOk = ok;
+                checkpointDone = true;
+            });
+            if (wait) finishCheckpoint(true);
+        }
+
+        // Import a text .dat file; the journal can't describe that, so it is followed by a checkpoint
+        void importText(const string& filename) {
+            loadFromFile(filename);
+            checkpoint(true);
+            compressCold();
+            spillCold();
+        }
+
+        // Save the file system in the text .dat format. The tree is cut into pieces in file order: single
+        // files and whole subtrees, with the largest subtrees split into their entries until there are
+        // enough pieces to go around. Workers render pieces into separate buffers, a window at a time,
+        // and the buffers are written in order, so the file is the same for any number of threads.
         void saveToFile(const string& filename) {
+            FS_TIME_SCOPE("save_text");
             ofstream fout(filename);
             if (!fout) {
-                cout << "Failed to save.\n";
+                error() << "Failed to save.\n";
                 return;
             }
-        
-            // Save files in root
-            for (auto& f : root.files) {
-                fout << "FILE " << f.second.name << " " << f.second.content << endl;
+            tree.expandAll(NodeArena::ROOT, out()); // The text format has no way to leave a subtree where it is
+
+            enum PieceKind : uint8_t { OPEN, CLOSE, FILE_LINE, SUBTREE };
+            struct Piece {
+                PieceKind kind;
+                NodeId node;
+            };
+            auto entries = [&](NodeId dir, vector<Piece>& out) {
+                for (NodeId f : tree.files(dir)) out.push_back({FILE_LINE, f});
+                for (NodeId d : tree.subdirectories(dir)) out.push_back({SUBTREE, d});
+            };
+            vector<Piece> pieces;
+            entries(NodeArena::ROOT, pieces);
+            for (int round = 0; round < SPLIT_ROUNDS; round++) {
+                size_t subtrees = count_if(pieces.begin(), pieces.end(), [](const Piece& p) { return p.kind == SUBTREE; });
+                if (subtrees == 0 || subtrees >= threads * PIECES_PER_THREAD) break;
+                vector<Piece> split;
+                for (const Piece& p : pieces) {
+                    if (p.kind != SUBTREE) {
+                        split.push_back(p);
+                        continue;
+                    }
+                    split.push_back({OPEN, p.node});
+                    entries(p.node, split);
+                    split.push_back({CLOSE, p.node});
+                }
+                pieces.swap(split);
             }
-        
-            // Save subdirectories in root
-            for (auto& d : root.subdirectories) {
-                saveDir(fout, d.second);
+
+            WorkStealingPool& workers = threadPool();
+            size_t window = threads * PIECES_PER_THREAD;
+            vector<string> buffers(window);
+            vector<ostringstream> problems(window); // Reported by each piece, printed as it is written
+            for (size_t from = 0; from < pieces.size(); from += window) {
+                size_t count = min(window, pieces.size() - from);
+                workers.forEachIndex(count, [&](size_t, size_t i) {
+                    const Piece& p = pieces[from + i];
+                    buffers[i].clear();
+                    if (p.kind == FILE_LINE) saveFile(buffers[i], p.node, problems[i]);
+                    else if (p.kind == SUBTREE) saveDir(buffers[i], p.node, problems[i]);
+                });
+                for (size_t i = 0; i < count; i++) {
+                    const Piece& p = pieces[from + i];
+                    if (p.kind == OPEN) fout << "DIR " << tree.name(p.node) << '\n';
+                    else if (p.kind == CLOSE) fout << "ENDDIR\n";
+                    else fout << buffers[i];
+                    string().swap(buffers[i]);
+                    out() << problems[i].str();
+                    problems[i].str("");
+                }
             }
-        
             fout.close();
-        }    
-        
-    
-        void saveDir(ofstream& fout, Directory& dir) {
-            fout << "DIR " << dir.name << endl; // Write directory name
-            for (auto& f : dir.files) {
-                fout << "FILE " << f.second.name << " " << f.second.content << endl; // Write file name and content
-            }
-            for (auto& d : dir.subdirectories) {
-                saveDir(fout, d.second); // Recursively save subdirectories
-            }
-            fout << "ENDDIR\n"; // Mark the end of the directory
         }
-    
-        // Load the file system
+
+        static constexpr size_t PIECES_PER_THREAD = 8; // Enough pieces that uneven subtrees still balance
+        static constexpr int SPLIT_ROUNDS = 4; // Levels of subtrees split up at most
+
+        void saveFile(string& out, NodeId file, ostream& err) const {
+            out += "FILE ";
+            out += tree.name(file);
+            out += ' ';
+            tree.file(file).view(err).forEachPiece([&](string_view piece) { out += piece; }); // Write file name and content
+            out += '\n';
+        }
+
+        void saveDir(string& out, NodeId dir, ostream& err) const {
+            out += "DIR ";
+            out += tree.name(dir); // Write directory name
+            out += '\n';
+            for (NodeId f : tree.files(dir)) saveFile(out, f, err);
+            for (NodeId d : tree.subdirectories(dir)) saveDir(out, d, err); // Recursively save subdirectories
+            out += "ENDDIR\n"; // Mark the end of the directory
+        }
+
+        // Load the file system from the text .dat format. The text has no index, so it is parsed in one
+        // pass; chunking and hashing the contents into blocks, most of the work, then runs on the pool.
         void loadFromFile(const string& filename) {
+            FS_TIME_SCOPE("load_text");
             ifstream fin(filename);
             if (!fin) {
-                cout << "No save file found. Starting new filesystem.\n"; // Handle missing save file
+                error() << "No save file found. Starting new filesystem.\n"; // Handle missing save file
                 return;
             }
-            root = Directory("root", nullptr); // Reset the root directory
-            currentDir = &root; // Reset the current directory
-            loadDir(fin, &root); // Load the root directory and its contents
+            tree.clear(); // Reset the root directory
+            enterDir(NodeArena::ROOT); // Reset the current directory
+            vector<PendingContent> pending;
+            unordered_map<NodeId, size_t> latest; // Last pending entry of each file slot
+            unordered_set<NodeId> renamed; // Entries loaded under another name, see loadDir()
+            loadDir(fin, NodeArena::ROOT, pending, latest, renamed); // Load the root directory and its contents
             fin.close();
+
+            BlockStore& store = BlockStore::instance();
+            threadPool().forEachIndex(pending.size(), [&](size_t, size_t i) {
+                NodeId node = pending[i].node;
+                if (latest.at(node) != i || !tree.isLive(node) || tree.isDir(node)) return; // Replaced by a later entry
+                tree.file(node).content = store.build(string_view(pending[i].content)); // Shared blocks
+                string().swap(pending[i].content);
+            });
+            for (size_t i = 0; i < pending.size(); i++) {
+                NodeId node = pending[i].node;
+                if (latest.at(node) == i && tree.isLive(node) && !tree.isDir(node)) tree.resized(node);
+            }
+            tree.rechargeAll();
         }
-    
-        void loadDir(ifstream& fin, Directory* dir) {
+
+        struct PendingContent {
+            NodeId node;
+            string content;
+        };
+
+        // Files and directories used to have separate namespaces, so an old file can hold both under one
+        // name. The later of the two is loaded under a free name instead, and so is any entry that would
+        // replace one renamed that way; otherwise a repeated name replaces the earlier entry, as it always has.
+        void loadDir(ifstream& fin, NodeId dir, vector<PendingContent>& pending, unordered_map<NodeId, size_t>& latest,
+                     unordered_set<NodeId>& renamed) {
             string type, name, content;
             while (fin >> type) {
-                if (type == "DIR") {
+                bool moved = false;
+                if (type == "DIR" || type == "FILE") {
                     fin >> name;
-                    dir->subdirectories[name] = Directory(name, dir); // Create a new subdirectory
-                    loadDir(fin, &dir->subdirectories[name]); // Recursively load subdirectories
+                    NodeId existing = childOf(dir, name);
+                    if (existing != NO_NODE && (tree.isDir(existing) != (type == "DIR") || renamed.count(existing))) {
+                        string original = name;
+                        for (size_t n = 1; childOf(dir, name) != NO_NODE; n++) name = original + "~" + to_string(n);
+                        string parent = dir == NodeArena::ROOT ? "" : tree.pathOf(dir);
+                        out() << "Warning: " << parent << "/" << original << " is loaded as " << name << " so as not to clash with the "
+                              << (tree.isDir(existing) ? "directory" : "file") << " of that name.\n";
+                        moved = true;
+                    } else if (existing != NO_NODE) {
+                        tree.remove(existing);
+                    }
+                }
+                if (type == "DIR") {
+                    NodeId d = tree.addDir(dir, name);
+                    if (moved) renamed.insert(d);
+                    loadDir(fin, d, pending, latest, renamed); // Load the new subdirectory recursively
                 } else if (type == "FILE") {
-                    fin >> name;
                     getline(fin, content);
-                    if (!content.empty() && content[0] == ' ') content = content.substr(1); // Remove leading space
-                    dir->files[name] = File(name); // Create a new file
-                    dir->files[name].content = content; // Set file content
+                    if (!content.empty() && content[0] == ' ') content.erase(0, 1); // Remove leading space
+                    NodeId f = tree.addFile(dir, name);
+                    if (moved) renamed.insert(f);
+                    latest[f] = pending.size();
+                    pending.push_back({f, move(content)});
                 } else if (type == "ENDDIR") {
                     break; // End of the current directory
                 }
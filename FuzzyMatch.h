@@ -0,0 +1,189 @@
+#pragma once
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <vector>
+#include "NodeArena.h"
+
+using namespace std;
+
+
+// Edit distance (insertions, deletions, substitutions) between a and b, bounded by limit: the exact
+// distance when it is <= limit, otherwise limit + 1. Never touches the heap.
+// When the shorter string fits in a machine word this is Myers' bit-parallel algorithm, one pass of
+// a handful of word operations per character of the longer string. Longer pairs fall back to a DP
+// restricted to the diagonal band |i - j| <= limit, with the band capped at MAX_BAND.
+constexpr int MAX_BAND = 32; // Widest band the long-string path keeps on the stack
+
+int editDistance(string_view a, string_view b, int limit = INT_MAX) {
+    if (a.size() > b.size()) swap(a, b); // a is the pattern, b the text
+    int m = a.size(), n = b.size();
+    if (limit < 0) return 0;
+    limit = min(limit, n); // The distance never exceeds the longer length
+    if (n - m > limit) return limit + 1; // Every extra character costs one insertion
+    if (m == 0) return n;
+
+    if (m <= 64) {
+        uint64_t peq[256]; // Bit i set for character c when a[i] == c
+        memset(peq, 0, sizeof(peq));
+        for (int i = 0; i < m; i++) peq[uint8_t(a[i])] |= uint64_t(1) << i;
+        uint64_t pv = m == 64 ? ~uint64_t(0) : (uint64_t(1) << m) - 1, mv = 0; // Vertical +1 / -1 deltas
+        uint64_t last = uint64_t(1) << (m - 1);
+        int score = m;
+        for (int j = 0; j < n; j++) {
+            uint64_t eq = peq[uint8_t(b[j])];
+            uint64_t xv = eq | mv;
+            uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+            uint64_t ph = mv | ~(xh | pv), mh = pv & xh; // Horizontal +1 / -1 deltas
+            if (ph & last) score++;
+            else if (mh & last) score--;
+            ph = (ph << 1) | 1; // Row 0 grows by one per column
+            mh <<= 1;
+            pv = mh | ~(xv | ph);
+            mv = ph & xv;
+            if (score - (n - 1 - j) > limit) return limit + 1; // Can drop at most one per remaining column
+        }
+        return min(score, limit + 1);
+    }
+
+    int k = min(limit, MAX_BAND);
+    if (n - m > k) return k + 1;
+    const int INF = k + 1;
+    int rows[2][2 * MAX_BAND + 1]; // Band of the previous and current row, index d = j - i + k
+    int* prev = rows[0];
+    int* cur = rows[1];
+    for (int d = 0; d <= 2 * k; d++) prev[d] = d >= k ? d - k : INF;
+    for (int i = 1; i <= m; i++) {
+        int best = INF;
+        for (int d = 0; d <= 2 * k; d++) {
+            int j = i + d - k;
+            if (j < 0 || j > n) {
+                cur[d] = INF;
+                continue;
+            }
+            int v = j == 0 ? i : prev[d] + (a[i - 1] != b[j - 1]); // Diagonal
+            if (d + 1 <= 2 * k) v = min(v, prev[d + 1] + 1); // From (i - 1, j)
+            if (d > 0) v = min(v, cur[d - 1] + 1); // From (i, j - 1)
+            cur[d] = min(v, INF);
+            best = min(best, cur[d]);
+        }
+        if (best > k) return k + 1;
+        swap(prev, cur);
+    }
+    return prev[n - m + k];
+}
+
+// Largest distance still worth suggesting for a word of this length
+int suggestionLimit(size_t length) { return min<int>(3, 1 + length / 3); }
+
+
+// BK-tree over a set of names: children hang off their parent by their edit distance to it, so a
+// query within radius r only descends into edges in [d - r, d + r]. Used for directories too large
+// to scan on every typo. Names are views into storage the owner keeps alive. Distances are capped at
+// MAX_BAND + 1, which keeps them a metric and the pruning exact for any limit below that.
+class BKTree {
+    private:
+        struct Entry {
+            string_view name;
+            uint32_t value; // Caller's payload
+            uint32_t distance; // Edit distance to the parent entry
+            uint32_t firstChild, nextSibling; // Children as a linked list, indices into entries
+        };
+        static constexpr uint32_t NONE = UINT32_MAX;
+        vector<Entry> entries; // entries[0] is the root
+
+    public:
+        void clear() { entries.clear(); }
+        size_t size() const { return entries.size(); }
+
+        void insert(string_view name, uint32_t value) {
+            entries.push_back({name, value, 0, NONE, NONE});
+            uint32_t added = entries.size() - 1;
+            if (added == 0) return;
+            uint32_t at = 0;
+            while (true) {
+                uint32_t d = editDistance(name, entries[at].name, MAX_BAND); // Capped the same way as in nearest()
+                if (d == 0) return; // Duplicate name, the first entry answers for it
+                uint32_t c = entries[at].firstChild;
+                while (c != NONE && entries[c].distance != d) c = entries[c].nextSibling;
+                if (c == NONE) {
+                    entries[added].distance = d;
+                    entries[added].nextSibling = entries[at].firstChild;
+                    entries[at].firstChild = added;
+                    return;
+                }
+                at = c;
+            }
+        }
+
+        // Value of the closest accepted name within limit (ties go to the smaller name), or UINT32_MAX
+        template <typename Accept>
+        uint32_t nearest(string_view query, int limit, Accept accept) const {
+            uint32_t best = NONE;
+            int bestDist = limit + 1;
+            string_view bestName;
+            vector<uint32_t> stack;
+            if (!entries.empty()) stack.push_back(0);
+            while (!stack.empty()) {
+                const Entry& e = entries[stack.back()];
+                stack.pop_back();
+                int d = editDistance(query, e.name, MAX_BAND);
+                if (d <= limit && accept(e.value) && (d < bestDist || (d == bestDist && e.name < bestName))) {
+                    best = e.value;
+                    bestDist = d;
+                    bestName = e.name;
+                }
+                int radius = min(limit, bestDist); // Ties are still wanted, farther ones are not
+                for (uint32_t c = e.firstChild; c != NONE; c = entries[c].nextSibling) {
+                    if (abs(int(entries[c].distance) - d) <= radius) stack.push_back(c);
+                }
+            }
+            return best;
+        }
+
+        size_t memoryUsage() const { return entries.capacity() * sizeof(Entry); }
+};
+
+
+// Closest existing name in a directory, for "Did you mean" hints after a failed lookup.
+// Small directories are scanned directly. Large ones get a BK-tree, built on first use and kept until
+// the tree changes, so repeated typos in a directory of a million entries stay interactive.
+class NameSuggester {
+    public:
+        static constexpr size_t INDEX_THRESHOLD = 4096; // Children before a directory is indexed
+
+    private:
+        BKTree index;
+        NodeId indexedDir = NO_NODE;
+        uint64_t indexedGeneration = 0; // NodeArena::generation(indexedDir) the index was built at
+
+    public:
+        // Closest child of dir to name (directories only, or files only), or NO_NODE if none is close
+        NodeId closest(const NodeArena& tree, NodeId dir, string_view name, bool wantDir) {
+            int limit = suggestionLimit(name.size());
+            auto accept = [&](NodeId c) { return tree.isDir(c) == wantDir; };
+            if (tree.childCount(dir) < INDEX_THRESHOLD) {
+                NodeId best = NO_NODE;
+                int bestDist = limit + 1;
+                tree.forEachChild(dir, [&](NodeId c) {
+                    if (!accept(c)) return;
+                    int d = editDistance(name, tree.name(c), bestDist);
+                    if (d < bestDist || (d == bestDist && d <= limit && tree.name(c) < tree.name(best))) {
+                        best = c;
+                        bestDist = d;
+                    }
+                });
+                return best;
+            }
+            if (indexedDir != dir || indexedGeneration != tree.generation(dir)) {
+                index.clear();
+                tree.forEachChild(dir, [&](NodeId c) { index.insert(tree.name(c), c); });
+                indexedDir = dir;
+                indexedGeneration = tree.generation(dir);
+            }
+            uint32_t best = index.nearest(name, limit, accept);
+            return best == UINT32_MAX ? NO_NODE : best;
+        }
+};
@@ -0,0 +1,264 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+
+// One journaled mutation. `dir` is the path from root to the directory the command ran in.
+struct JournalRecord {
+    enum Op : uint8_t { CREATE = 1, DELETE, MKDIR, MOVE, WRITE, WRITE_AT, MOVE_WITHIN, TRUNCATE, COPY };
+
+    Op op = CREATE;
+    vector<string> dir = {}; // Directory components below root
+    string name = {}; // File or directory the command names
+    string text = {}; // Written text (WRITE, WRITE_AT) or destination path (MOVE, COPY)
+    int64_t a = 0, b = 0, c = 0; // Positions and sizes, in the order the command takes them
+};
+
+
+// Append-only operation journal with group commit.
+// Each record is framed as [u32 payload length][u32 CRC-32 of payload][payload], with the payload
+// using varints for every number, so a torn write at the tail is detected and dropped on replay.
+// append() only buffers; a flusher thread writes and fdatasync()s the whole pending batch once
+// GROUP_RECORDS records are waiting or the oldest one has waited GROUP_DELAY.
+class Journal {
+    public:
+        static constexpr size_t GROUP_RECORDS = 64; // Records per forced fsync
+        static constexpr chrono::milliseconds GROUP_DELAY{20}; // Longest a record waits for its fsync
+
+    private:
+        int fd = -1; // Journal file, opened for append
+        atomic<uint64_t> bytes{0}; // Size of the journal including records not yet written; read without the lock
+        string pending; // Encoded records waiting for the next group commit
+        size_t pendingRecords = 0;
+        chrono::steady_clock::time_point oldestPending; // When the first pending record was appended
+        uint64_t appended = 0, durable = 0; // Record sequence numbers, to let sync() wait for its batch
+        bool stopping = false;
+        bool syncRequested = false; // A caller is waiting in sync(), don't hold the batch back
+        bool failed = false; // A write or fdatasync failed: durable stops there and later records are refused
+        mutex lock;
+        condition_variable wake, synced;
+        thread flusher;
+
+        static uint32_t crc32(const char* data, size_t len) {
+            static const vector<uint32_t> table = [] {
+                vector<uint32_t> t(256);
+                for (uint32_t i = 0; i < 256; i++) {
+                    uint32_t c = i;
+                    for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                    t[i] = c;
+                }
+                return t;
+            }();
+            uint32_t crc = 0xFFFFFFFFu;
+            for (size_t i = 0; i < len; i++) crc = table[(crc ^ (uint8_t)data[i]) & 0xFF] ^ (crc >> 8);
+            return crc ^ 0xFFFFFFFFu;
+        }
+
+        static void putVarint(string& out, uint64_t v) {
+            while (v >= 0x80) {
+                out += char((v & 0x7F) | 0x80);
+                v >>= 7;
+            }
+            out += char(v);
+        }
+        static void putSigned(string& out, int64_t v) { putVarint(out, (uint64_t(v) << 1) ^ uint64_t(v >> 63)); } // Zigzag
+        static void putString(string& out, const string& s) {
+            putVarint(out, s.size());
+            out += s;
+        }
+
+        static bool getVarint(const char*& p, const char* end, uint64_t& v) {
+            v = 0;
+            for (int shift = 0; p < end && shift < 64; shift += 7) {
+                uint8_t byte = *p++;
+                v |= uint64_t(byte & 0x7F) << shift;
+                if (!(byte & 0x80)) return true;
+            }
+            return false;
+        }
+        static bool getSigned(const char*& p, const char* end, int64_t& v) {
+            uint64_t z;
+            if (!getVarint(p, end, z)) return false;
+            v = int64_t(z >> 1) ^ -int64_t(z & 1);
+            return true;
+        }
+        static bool getString(const char*& p, const char* end, string& s) {
+            uint64_t len;
+            if (!getVarint(p, end, len) || len > uint64_t(end - p)) return false;
+            s.assign(p, len);
+            p += len;
+            return true;
+        }
+
+        static string encode(const JournalRecord& r) {
+            string payload;
+            payload += char(r.op);
+            putVarint(payload, r.dir.size());
+            for (const string& part : r.dir) putString(payload, part);
+            putString(payload, r.name);
+            putString(payload, r.text);
+            putSigned(payload, r.a);
+            putSigned(payload, r.b);
+            putSigned(payload, r.c);
+
+            uint32_t header[2] = {uint32_t(payload.size()), crc32(payload.data(), payload.size())};
+            return string((const char*)header, sizeof(header)) + payload;
+        }
+
+        static bool decode(const char* p, const char* end, JournalRecord& r) {
+            if (p == end || *p < JournalRecord::CREATE || *p > JournalRecord::COPY) return false;
+            r.op = JournalRecord::Op(*p++);
+            uint64_t parts;
+            if (!getVarint(p, end, parts) || parts > uint64_t(end - p)) return false;
+            r.dir.assign(parts, "");
+            for (string& part : r.dir) {
+                if (!getString(p, end, part)) return false;
+            }
+            return getString(p, end, r.name) && getString(p, end, r.text) &&
+                   getSigned(p, end, r.a) && getSigned(p, end, r.b) && getSigned(p, end, r.c) && p == end;
+        }
+
+        static bool writeAll(int fd, const char* data, size_t len) {
+            while (len > 0) {
+                ssize_t n = ::write(fd, data, len);
+                if (n <= 0) return false;
+                data += n;
+                len -= n;
+            }
+            return true;
+        }
+
+        void flushLoop() {
+            unique_lock<mutex> guard(lock);
+            while (true) {
+                wake.wait(guard, [&] { return stopping || pendingRecords > 0; });
+                if (pendingRecords == 0 && stopping) return;
+                // Give the batch a chance to fill up before paying for the fsync
+                wake.wait_until(guard, oldestPending + GROUP_DELAY,
+                                [&] { return stopping || syncRequested || pendingRecords >= GROUP_RECORDS; });
+                syncRequested = false;
+                string batch;
+                batch.swap(pending);
+                pendingRecords = 0;
+                uint64_t batchEnd = appended;
+                bool ok = !failed; // Never write past a batch that didn't make it: replay would skip the gap
+                guard.unlock();
+                if (ok && (!writeAll(fd, batch.data(), batch.size()) || fdatasync(fd) != 0)) {
+                    cerr << "Error: Failed to write the journal.\n";
+                    ok = false;
+                }
+                guard.lock();
+                if (ok) durable = batchEnd;
+                else failed = true;
+                synced.notify_all();
+            }
+        }
+
+    public:
+        Journal() = default;
+        Journal(const Journal&) = delete;
+        Journal& operator=(const Journal&) = delete;
+        ~Journal() { close(); }
+
+        // Open (creating if needed) a journal for appending. validBytes cuts off a torn tail found by replay().
+        bool open(const string& filename, uint64_t validBytes) {
+            close();
+            fd = ::open(filename.c_str(), O_WRONLY | O_CREAT, 0644);
+            if (fd < 0) return false;
+            if (ftruncate(fd, validBytes) != 0 || lseek(fd, 0, SEEK_END) < 0) {
+                ::close(fd);
+                fd = -1;
+                return false;
+            }
+            bytes = validBytes;
+            stopping = syncRequested = failed = false;
+            appended = durable = 0;
+            flusher = thread(&Journal::flushLoop, this);
+            return true;
+        }
+
+        bool isOpen() const { return fd >= 0; }
+        uint64_t size() const { return bytes; }
+
+        // Queue a record for the next group commit. False once the journal has failed: the record is
+        // dropped and the change it describes exists in memory only.
+        bool append(const JournalRecord& record) {
+            string encoded = encode(record);
+            lock_guard<mutex> guard(lock);
+            if (failed) return false;
+            if (pendingRecords == 0) oldestPending = chrono::steady_clock::now();
+            pending += encoded;
+            pendingRecords++;
+            appended++;
+            bytes += encoded.size();
+            wake.notify_one();
+            return true;
+        }
+
+        // Block until everything appended so far is on disk. False if the journal failed first, in which
+        // case it never will be.
+        bool sync() {
+            unique_lock<mutex> guard(lock);
+            if (fd < 0) return true;
+            uint64_t target = appended;
+            if (durable < target && !failed) {
+                syncRequested = true;
+                wake.notify_one();
+                synced.wait(guard, [&] { return durable >= target || failed; });
+            }
+            return !failed;
+        }
+
+        // Drain and close. False if some appended record never reached disk.
+        bool close() {
+            if (fd < 0) return true;
+            {
+                lock_guard<mutex> guard(lock);
+                stopping = true; // The flusher drains what is pending before it exits
+                wake.notify_one();
+            }
+            flusher.join();
+            ::close(fd);
+            fd = -1;
+            return !failed;
+        }
+
+        // Feed every intact record of a journal file to apply(). Returns the length of the valid prefix
+        // (0 if the file does not exist); anything after it is a torn or corrupt tail.
+        static uint64_t replay(const string& filename, const function<void(const JournalRecord&)>& apply) {
+            int in = ::open(filename.c_str(), O_RDONLY);
+            if (in < 0) return 0;
+            string data;
+            char buf[1 << 16];
+            ssize_t n;
+            while ((n = ::read(in, buf, sizeof(buf))) > 0) data.append(buf, n);
+            ::close(in);
+
+            size_t pos = 0;
+            while (data.size() - pos >= 8) {
+                uint32_t header[2];
+                memcpy(header, data.data() + pos, sizeof(header));
+                if (header[0] > data.size() - pos - 8) break;
+                const char* payload = data.data() + pos + 8;
+                if (crc32(payload, header[0]) != header[1]) break;
+                JournalRecord r;
+                if (!decode(payload, payload + header[0], r)) break;
+                apply(r);
+                pos += 8 + header[0];
+            }
+            return pos;
+        }
+};
@@ -0,0 +1,639 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "BlockStore.h"
+#include "File.h"
+#include "StableVector.h"
+#include "StringPool.h"
+
+using namespace std;
+
+using NodeId = uint32_t; // Stable index of a node in the arena
+constexpr NodeId NO_NODE = UINT32_MAX;
+constexpr uint32_t NOT_STORED = UINT32_MAX; // Node::stored of a directory whose entries are all loaded
+
+
+// What lies below a directory: content bytes, files and directories, all the way down
+struct Totals {
+    uint64_t bytes = 0;
+    uint32_t files = 0, dirs = 0;
+};
+
+
+// One entry of the tree, either a directory or a file
+struct Node {
+    uint64_t pathHash; // Hash of the absolute path, the key of the node in the path index
+    NameId name; // Interned name
+    NodeId parent; // Containing directory (NO_NODE for root)
+    NodeId firstChild; // Head of the child list (directories only)
+    NodeId prevSibling, nextSibling; // Links in the parent's child list
+    uint32_t blob; // Index of the File in the blob region (files only)
+    uint32_t childCount; // Entries directly inside (directories only)
+    uint32_t stored; // Stub directories: record of the directory in the lazy source, its entries not loaded yet
+    bool isDir;
+    bool live; // False while the slot is on the free list
+    uint32_t serial; // Stamped from a process-wide counter when allocated, tells a reused slot from its last owner
+    Totals below; // Directories: everything below, stubs included. Files: the content size last accounted
+    uint64_t changedAt; // Directories: generation() when an entry was last added, removed or renamed here
+};
+
+
+// The whole tree in one contiguous node array. Nodes refer to each other by index, names are
+// interned in a shared pool, and file contents sit in a separate blob array.
+// Every node is indexed by a hash of its absolute path, built incrementally from its parent's
+// hash and its own name. A child lookup is one probe, and so is a whole path: its hash is folded
+// from the components without touching the nodes in between, then the candidate is verified.
+//
+// Every directory keeps the totals of its subtree, updated along the parent chain whenever an entry is
+// added, removed or moved, or a file changes size (see resized()), so sizes are O(1) to read.
+//
+// A tree opened lazily (see Snapshot::openLazy) starts out with stub directories: nodes whose entries
+// are still in the source and not in the arena or the path index. expand() loads one level of them.
+// Lookups don't expand anything on their own; callers expand a directory before they look inside.
+//
+// An arena used by several threads at once (see setConcurrent) locks what all directories share: the
+// path index, the name pool, the free lists and the totals up the parent chain. What a node holds of its
+// own (name, parent, child links, file) is up to the caller, who holds the node's directory while it
+// reads or changes it (FileSystem locks directories). Slots never move, so a node or file stays put
+// while other directories grow the arena.
+class NodeArena {
+    public:
+        // Where stub directories get their entries from
+        class LazySource {
+            public:
+                virtual ~LazySource() = default;
+                virtual bool expand(NodeArena& tree, NodeId dir, uint32_t record, ostream& err) const = 0; // Add the entries of record to dir; false (reported on err) if damaged
+        };
+
+    private:
+        StableVector<Node> nodes; // Node slots, index = NodeId
+        vector<NodeId> freeNodes; // Slots of removed nodes, reused first
+        StableVector<File> blobs; // File contents, index = Node::blob
+        vector<uint32_t> freeBlobs; // Blob slots of removed files
+        StringPool names;
+        unordered_multimap<uint64_t, NodeId> pathIndex; // Path hash -> node (collisions are resolved by verifying)
+        size_t liveNodes = 0;
+        uint64_t changes = 0; // See generation()
+        shared_ptr<const LazySource> lazy; // Source of the stub directories, shared with copies of the tree
+        size_t stubs = 0; // Directories not expanded yet
+        size_t resident = 0; // Sum of File::charged, see recharge()
+
+        // See setConcurrent. A copy of the arena starts with a lock of its own, off, and an arena that is
+        // assigned another keeps its own.
+        struct Guard {
+            mutable shared_mutex m;
+            bool on = false;
+            Guard() = default;
+            Guard(const Guard&) {}
+            Guard& operator=(const Guard&) { return *this; }
+        } guard;
+
+        shared_lock<shared_mutex> reading() const { return guard.on ? shared_lock<shared_mutex>(guard.m) : shared_lock<shared_mutex>(); }
+        unique_lock<shared_mutex> writing() { return guard.on ? unique_lock<shared_mutex>(guard.m) : unique_lock<shared_mutex>(); }
+
+        // Stamp the arena with a value no arena in this process has had, so caches keyed on
+        // generation() can't mistake a replaced tree for the one they were built from
+        void changed() {
+            static atomic<uint64_t> counter{0};
+            changes = ++counter;
+        }
+
+        static uint64_t hashName(string_view name) { return hash<string_view>()(name); }
+
+        // Hash of parent/name, given the hash of parent's path
+        static uint64_t extend(uint64_t parentHash, uint64_t nameHash) {
+            uint64_t z = parentHash * 0x9E3779B97F4A7C15ull + nameHash + 0x632BE59BD9B4E019ull; // splitmix64 finalizer
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            return z ^ (z >> 31);
+        }
+
+        void unindex(NodeId id) {
+            auto range = pathIndex.equal_range(nodes[id].pathHash);
+            for (auto it = range.first; it != range.second; ++it) {
+                if (it->second == id) {
+                    pathIndex.erase(it);
+                    return;
+                }
+            }
+        }
+
+        // Recompute the path hashes under a directory that was renamed or moved
+        void reindexChildren(NodeId dir) {
+            forEachChild(dir, [&](NodeId c) {
+                unindex(c);
+                nodes[c].pathHash = extend(nodes[dir].pathHash, hashName(name(c)));
+                pathIndex.emplace(nodes[c].pathHash, c);
+                if (nodes[c].isDir) reindexChildren(c);
+            });
+        }
+
+        NodeId allocate(NodeId parent, NameId name, bool isDir) {
+            NodeId id;
+            if (!freeNodes.empty()) {
+                id = freeNodes.back();
+                freeNodes.pop_back();
+            } else {
+                id = nodes.size();
+                nodes.emplace_back();
+            }
+            static atomic<uint32_t> serials{0};
+            nodes[id] = Node{0, name, parent, NO_NODE, NO_NODE, NO_NODE, NO_NODE, 0, NOT_STORED, isDir, true, ++serials, Totals{}, 0};
+            liveNodes++;
+            if (parent != NO_NODE) {
+                link(parent, id);
+                adjust(parent, weight(id), true);
+            }
+            return id;
+        }
+
+        void link(NodeId parent, NodeId id) {
+            Node& n = nodes[id];
+            n.prevSibling = NO_NODE;
+            n.nextSibling = nodes[parent].firstChild;
+            if (n.nextSibling != NO_NODE) nodes[n.nextSibling].prevSibling = id;
+            nodes[parent].firstChild = id;
+            nodes[parent].childCount++;
+            changed();
+            nodes[parent].changedAt = changes;
+            n.pathHash = extend(nodes[parent].pathHash, hashName(names.str(n.name)));
+            pathIndex.emplace(n.pathHash, id);
+        }
+
+        // Add t to, or take it away from, every directory from dir up to the root
+        void adjust(NodeId dir, Totals t, bool add) { // By value: t may be the totals of dir itself
+            for (NodeId d = dir; d != NO_NODE; d = nodes[d].parent) {
+                Totals& b = nodes[d].below;
+                if (add) {
+                    b.bytes += t.bytes;
+                    b.files += t.files;
+                    b.dirs += t.dirs;
+                } else {
+                    b.bytes -= t.bytes;
+                    b.files -= t.files;
+                    b.dirs -= t.dirs;
+                }
+            }
+        }
+
+        // What a node adds to the totals of the directories above it: itself and everything below it
+        Totals weight(NodeId id) const {
+            Totals t = nodes[id].below;
+            if (nodes[id].isDir) t.dirs++;
+            else t.files++;
+            return t;
+        }
+
+        // Drop a node and everything under it; the totals above were already adjusted by remove()
+        void release(NodeId id) {
+            Node& n = nodes[id];
+            if (n.isDir) {
+                while (nodes[id].firstChild != NO_NODE) release(nodes[id].firstChild);
+            } else {
+                resident -= blobs[n.blob].charged;
+                blobs[n.blob] = File(); // Release the content now rather than when the slot is reused
+                freeBlobs.push_back(n.blob);
+            }
+            if (isStub(id)) stubs--; // Its stored entries simply go with it
+            unlink(id);
+            nodes[id].live = false;
+            freeNodes.push_back(id);
+            liveNodes--;
+        }
+
+        void unlink(NodeId id) {
+            Node& n = nodes[id];
+            if (n.prevSibling != NO_NODE) nodes[n.prevSibling].nextSibling = n.nextSibling;
+            else nodes[n.parent].firstChild = n.nextSibling;
+            if (n.nextSibling != NO_NODE) nodes[n.nextSibling].prevSibling = n.prevSibling;
+            nodes[n.parent].childCount--;
+            changed();
+            nodes[n.parent].changedAt = changes;
+            unindex(id);
+        }
+
+        NodeId lookup(NodeId dir, NameId name) const {
+            auto range = pathIndex.equal_range(extend(nodes[dir].pathHash, hashName(names.str(name))));
+            for (auto it = range.first; it != range.second; ++it) {
+                if (nodes[it->second].parent == dir && nodes[it->second].name == name) return it->second;
+            }
+            return NO_NODE;
+        }
+
+        NodeId newStub(NodeId parent, NameId name, uint32_t record, const Totals& below) {
+            NodeId id = allocate(parent, name, true);
+            nodes[id].stored = record;
+            nodes[id].below = below;
+            adjust(parent, below, true);
+            stubs++;
+            return id;
+        }
+
+        NodeId newFile(NodeId parent, NameId name) {
+            NodeId id = allocate(parent, name, false);
+            uint32_t blob;
+            if (!freeBlobs.empty()) {
+                blob = freeBlobs.back();
+                freeBlobs.pop_back();
+                blobs[blob] = File();
+            } else {
+                blob = blobs.size();
+                blobs.emplace_back();
+            }
+            nodes[id].blob = blob;
+            return id;
+        }
+
+        NodeId copyTree(NodeId src, NodeId newParent, NameId newName) {
+            if (isStub(src)) return newStub(newParent, newName, nodes[src].stored, nodes[src].below); // Both expand from the same record
+            if (!nodes[src].isDir) {
+                NodeId id = newFile(newParent, newName);
+                blobs[nodes[id].blob].shareContent(blobs[nodes[src].blob]); // Shares the tree, copies one pointer
+                account(id);
+                return id;
+            }
+            NodeId id = allocate(newParent, newName, true);
+            vector<NodeId> children; // Collected first: the copies are linked while we walk
+            forEachChild(src, [&](NodeId c) { children.push_back(c); });
+            for (NodeId c : children) copyTree(c, id, nodes[c].name);
+            return id;
+        }
+
+        void account(NodeId id) {
+            Totals delta;
+            uint64_t size = file(id).size(), old = nodes[id].below.bytes;
+            delta.bytes = size > old ? size - old : old - size;
+            adjust(nodes[id].parent, delta, size > old);
+            nodes[id].below.bytes = size;
+        }
+
+        vector<NodeId> sortedChildren(NodeId dir, bool wantDirs) const {
+            vector<NodeId> out;
+            forEachChild(dir, [&](NodeId c) { if (nodes[c].isDir == wantDirs) out.push_back(c); });
+            sort(out.begin(), out.end(), [&](NodeId a, NodeId b) { return name(a) < name(b); });
+            return out;
+        }
+
+    public:
+        static constexpr NodeId ROOT = 0;
+
+        NodeArena() { clear(); }
+
+        // Drop everything and start over with an empty root
+        void clear() {
+            nodes.clear();
+            freeNodes.clear();
+            blobs.clear();
+            freeBlobs.clear();
+            names = StringPool();
+            pathIndex.clear();
+            liveNodes = 0;
+            lazy.reset();
+            stubs = 0;
+            resident = 0;
+            changed();
+            allocate(NO_NODE, names.intern("root"), true);
+        }
+
+        // Let several threads use the arena at once, as described above. Loads and lazy expansion are
+        // not covered: a tree is loaded in full before it is shared.
+        void setConcurrent(bool on) { guard.on = on; }
+
+        // Child of dir called name, or NO_NODE
+        NodeId child(NodeId dir, string_view name) const {
+            auto lock = reading();
+            NameId id;
+            if (!names.find(name, id)) return NO_NODE; // Never-seen name, skip the hash probe
+            return lookup(dir, id);
+        }
+        NodeId child(NodeId dir, NameId name) const {
+            auto lock = reading();
+            return lookup(dir, name);
+        }
+
+        // Resolve a path ("/a/b", "../x", ".", "a/b") against cwd; NO_NODE if any part is missing, or
+        // with dirOnly if it names a file. '.' and '..' are folded lexically, the rest costs one index
+        // probe plus a check of the candidate's ancestors, no matter how deep the path or how large its
+        // directories.
+        NodeId resolve(NodeId cwd, string_view path, bool dirOnly = false) const {
+            auto lock = reading();
+            NodeId base = !path.empty() && path[0] == '/' ? ROOT : cwd;
+            vector<string_view> parts;
+            size_t pos = 0;
+            while (pos <= path.size()) {
+                size_t end = min(path.find('/', pos), path.size());
+                string_view part = path.substr(pos, end - pos);
+                pos = end + 1;
+                if (part.empty() || part == ".") continue;
+                if (part != "..") {
+                    parts.push_back(part);
+                } else if (!parts.empty()) {
+                    parts.pop_back();
+                } else if (nodes[base].parent != NO_NODE) {
+                    base = nodes[base].parent; // '..' above the starting point walks up from it
+                }
+            }
+            if (parts.empty()) return base;
+
+            uint64_t h = nodes[base].pathHash;
+            for (string_view part : parts) h = extend(h, hashName(part));
+            auto range = pathIndex.equal_range(h);
+            for (auto it = range.first; it != range.second; ++it) {
+                NodeId n = it->second;
+                size_t i = parts.size();
+                while (i > 0 && n != NO_NODE && name(n) == parts[i - 1]) {
+                    n = nodes[n].parent;
+                    i--;
+                }
+                if (i == 0 && n == base) return dirOnly && !nodes[it->second].isDir ? NO_NODE : it->second;
+            }
+            return NO_NODE;
+        }
+
+        // Absolute path of a node ("/" for root)
+        string pathOf(NodeId id) const {
+            if (id == ROOT) return "/";
+            vector<NodeId> chain;
+            for (NodeId n = id; n != ROOT; n = nodes[n].parent) chain.push_back(n);
+            string out;
+            for (auto it = chain.rbegin(); it != chain.rend(); ++it) out += "/" + name(*it);
+            return out;
+        }
+
+        // Names of the directories from root down to dir, root itself excluded
+        vector<string> components(NodeId dir) const {
+            vector<string> out;
+            for (NodeId n = dir; n != ROOT; n = nodes[n].parent) out.push_back(name(n));
+            reverse(out.begin(), out.end());
+            return out;
+        }
+
+        // True if node is dir or lies somewhere below it
+        bool isWithin(NodeId node, NodeId dir) const {
+            for (NodeId n = node; n != NO_NODE; n = nodes[n].parent) {
+                if (n == dir) return true;
+            }
+            return false;
+        }
+
+        NameId intern(string_view name) {
+            auto lock = writing();
+            return names.intern(name);
+        }
+
+        // Rebuild the name pool from the names of live nodes, dropping those only removed or renamed
+        // nodes had. Every NameId changes, so the caller must have the tree to itself and hold none.
+        void compactNames() {
+            auto lock = writing();
+            StringPool kept;
+            for (NodeId id = 0; id < nodes.size(); id++) {
+                if (nodes[id].live) nodes[id].name = kept.intern(names.str(nodes[id].name));
+            }
+            names = move(kept);
+        }
+        size_t nameCount() const { return names.size(); }
+
+        // Callers check that the name is free first
+        NodeId addDir(NodeId parent, string_view name) {
+            auto lock = writing();
+            return allocate(parent, names.intern(name), true);
+        }
+        NodeId addDir(NodeId parent, NameId name) {
+            auto lock = writing();
+            return allocate(parent, name, true);
+        }
+
+        // Directory whose entries will come from record of the lazy source on first expand(); below
+        // is what the source says they add up to
+        NodeId addStubDir(NodeId parent, NameId name, uint32_t record, const Totals& below) {
+            auto lock = writing();
+            return newStub(parent, name, record, below);
+        }
+
+        void setLazySource(shared_ptr<const LazySource> source) { lazy = move(source); }
+        const LazySource* lazySource() const { return lazy.get(); }
+
+        bool isStub(NodeId id) const { return nodes[id].stored != NOT_STORED; }
+        bool hasStubs() const { return stubs > 0; }
+        uint32_t storedRecord(NodeId dir) const { return nodes[dir].stored; }
+
+        // Load the entries of a stub directory (its subdirectories come in as stubs themselves)
+        void expand(NodeId dir, ostream& err) {
+            if (!isStub(dir)) return;
+            uint32_t record = nodes[dir].stored;
+            nodes[dir].stored = NOT_STORED;
+            stubs--;
+            adjust(dir, nodes[dir].below, false); // Counted again entry by entry as they come in
+            lazy->expand(*this, dir, record, err); // A damaged source reports itself and leaves what it could load
+        }
+
+        // Load everything below dir
+        void expandAll(NodeId dir, ostream& err) {
+            if (!stubs) return;
+            expand(dir, err);
+            forEachChild(dir, [&](NodeId c) { if (nodes[c].isDir) expandAll(c, err); });
+        }
+
+        NodeId addFile(NodeId parent, string_view name) {
+            auto lock = writing();
+            return newFile(parent, names.intern(name));
+        }
+        NodeId addFile(NodeId parent, NameId name) {
+            auto lock = writing();
+            return newFile(parent, name);
+        }
+
+        // Remove a file, or a directory with everything under it
+        void remove(NodeId id) {
+            auto lock = writing();
+            adjust(nodes[id].parent, weight(id), false);
+            release(id);
+        }
+
+        // Rename and/or move under another directory; the node keeps its id and its content is not
+        // touched. Paths below a moved directory are re-hashed.
+        void moveNode(NodeId id, NodeId newParent, string_view newName) {
+            auto lock = writing();
+            Totals t = weight(id);
+            adjust(nodes[id].parent, t, false);
+            unlink(id);
+            nodes[id].name = names.intern(newName);
+            nodes[id].parent = newParent;
+            link(newParent, id);
+            adjust(newParent, t, true);
+            if (nodes[id].isDir) reindexChildren(id);
+        }
+
+        // Copy a file, or a directory with everything under it, into newParent as newName. Contents are
+        // persistent ropes, so the copy shares them and costs one node per entry, whatever the size of
+        // the data; the two sides only diverge, piece by piece, when one of them is edited.
+        NodeId copyNode(NodeId src, NodeId newParent, NameId newName) {
+            auto lock = writing();
+            return copyTree(src, newParent, newName);
+        }
+
+        // Account for a change in the size of a file's content. Called after every edit and whenever a
+        // file gets its content from outside (loads, copies); costs one step per directory above it.
+        void resized(NodeId id) {
+            auto lock = writing();
+            account(id);
+        }
+
+        // Count a file's content held in memory (File::residentSize) against residentBytes(). Unlike the
+        // totals this is not kept up by every edit: the memory budget measures the files a command used
+        // once it is done with them, and everything at once with rechargeAll() after a load.
+        void recharge(File& f) {
+            size_t now = f.residentSize();
+            resident = resident - f.charged + now;
+            f.charged = now;
+        }
+
+        void rechargeAll() {
+            for (File& f : blobs) recharge(f);
+        }
+
+        size_t residentBytes() const { return resident; }
+
+        // Totals of everything below a directory (for a file: its size)
+        Totals totals(NodeId id) const {
+            auto lock = reading();
+            return nodes[id].below;
+        }
+
+        bool isDir(NodeId id) const { return nodes[id].isDir; }
+        bool isLive(NodeId id) const { return nodes[id].live; }
+        uint32_t serial(NodeId id) const { return nodes[id].serial; }
+
+        // True if slot id still holds the node that was stamped serial; unlike isLive() and serial(),
+        // for a node whose directory the caller doesn't hold
+        bool holds(NodeId id, uint32_t serial) const {
+            auto lock = reading();
+            return id < nodes.size() && nodes[id].live && nodes[id].serial == serial;
+        }
+
+        // Directory of the node stamped serial in slot id, or NO_NODE if that node is gone. Once the caller
+        // holds the directory, it must check that the node is still there: it may have moved on meanwhile.
+        NodeId parentOf(NodeId id, uint32_t serial) const {
+            auto lock = reading();
+            return id < nodes.size() && nodes[id].live && nodes[id].serial == serial ? nodes[id].parent : NO_NODE;
+        }
+        size_t capacity() const { return nodes.size(); } // Slots, live or free: every valid NodeId is below this
+        NameId nameId(NodeId id) const { return nodes[id].name; }
+        const string& name(NodeId id) const { return names.str(nodes[id].name); }
+        NodeId parent(NodeId id) const { return nodes[id].parent; }
+        bool hasChildren(NodeId dir) const { return nodes[dir].firstChild != NO_NODE; }
+        uint32_t childCount(NodeId dir) const { return nodes[dir].childCount; }
+
+        // Changes whenever an entry is added, removed, renamed or moved
+        uint64_t generation() const { return changes; }
+        // Same, for the entries directly inside dir only
+        uint64_t generation(NodeId dir) const { return nodes[dir].changedAt; }
+
+        File& file(NodeId id) { return blobs[nodes[id].blob]; }
+        const File& file(NodeId id) const { return blobs[nodes[id].blob]; }
+
+        // Every file slot, in no particular order (slots of removed files hold empty files)
+        template <typename Visitor>
+        void forEachFile(Visitor visit) {
+            for (File& f : blobs) visit(f);
+        }
+
+        // Unordered walk over the children of dir
+        template <typename Visitor>
+        void forEachChild(NodeId dir, Visitor visit) const {
+            for (NodeId c = nodes[dir].firstChild; c != NO_NODE; c = nodes[c].nextSibling) visit(c);
+        }
+
+        // Children by kind, sorted by name
+        vector<NodeId> subdirectories(NodeId dir) const { return sortedChildren(dir, true); }
+        vector<NodeId> files(NodeId dir) const { return sortedChildren(dir, false); }
+
+        size_t size() const { return liveNodes; }
+
+        // Heap bytes owned by one node: its slot, its index entry and, for files, the content.
+        // The name is shared through the pool and counted once in memoryUsage().
+        size_t nodeMemory(NodeId id) const {
+            size_t bytes = sizeof(Node) + sizeof(pair<const uint64_t, NodeId>) + 2 * sizeof(void*);
+            if (!nodes[id].isDir) bytes += sizeof(File) + file(id).memoryUsage();
+            return bytes;
+        }
+
+        // Where the memory of the tree goes, for the stats command. Walks every slot, so it is computed on demand.
+        struct MemoryStats {
+            size_t dirs = 0, files = 0; // Live nodes by kind
+            size_t contentBytes = 0, pieces = 0; // File contents and the rope pieces holding them
+            size_t storedBytes = 0, buffers = 0; // Buffers behind those pieces, each shared buffer counted once
+            size_t compressedFiles = 0, compressedRaw = 0, compressedBytes = 0; // Cold files: content size and packed size
+            size_t nodeBytes = 0; // Node slots, free ones included
+            size_t indexBytes = 0; // Path index buckets and entries
+            size_t nameBytes = 0; // Interned names
+            size_t blobBytes = 0; // File slots and rope piece overhead
+        };
+
+        MemoryStats memoryStats() const {
+            MemoryStats m;
+            for (const Node& n : nodes) {
+                if (!n.live) continue;
+                if (n.isDir) m.dirs++;
+                else m.files++;
+            }
+            for (const File& f : blobs) {
+                m.contentBytes += f.size();
+                m.pieces += f.content.pieces();
+                if (f.compressed()) {
+                    m.compressedFiles++;
+                    m.compressedRaw += f.size();
+                    m.compressedBytes += f.memoryUsage();
+                }
+            }
+            m.nodeBytes = nodes.capacity() * sizeof(Node) + freeNodes.capacity() * sizeof(NodeId);
+            m.indexBytes = pathIndex.bucket_count() * sizeof(void*) + pathIndex.size() * (sizeof(pair<const uint64_t, NodeId>) + sizeof(void*));
+            m.nameBytes = names.memoryUsage();
+            m.blobBytes = blobs.capacity() * sizeof(File) + freeBlobs.capacity() * sizeof(uint32_t);
+            for (const File& f : blobs) m.blobBytes += f.content.memoryUsage() - f.content.size();
+            m.storedBytes = storedBytes(&m.buffers);
+            return m;
+        }
+
+        // Bytes of all content buffers, each counted once however many pieces and files share it.
+        // The number of distinct buffers goes to *buffers if given.
+        size_t storedBytes(size_t* buffers = nullptr) const {
+            unordered_set<const string*> seen;
+            size_t bytes = 0;
+            for (const File& f : blobs) {
+                f.content.forEachBuffer([&](const shared_ptr<const string>& buffer) {
+                    if (seen.insert(buffer.get()).second) bytes += buffer->size();
+                });
+            }
+            if (buffers) *buffers = seen.size();
+            return bytes;
+        }
+
+        // Re-split every file into content-defined blocks from the block store, so identical regions of
+        // any files share one buffer. Contents don't change; small write pieces are folded into blocks.
+        void dedupContents() {
+            BlockStore& store = BlockStore::instance();
+            for (File& f : blobs) {
+                if (!f.content.empty()) f.content = store.build(f.content.view()); // Compressed files are left as they are
+            }
+        }
+
+        // Heap bytes of the whole tree, shared content buffers counted once
+        size_t memoryUsage() const {
+            size_t bytes = nodes.capacity() * sizeof(Node) + blobs.capacity() * sizeof(File) + names.memoryUsage() +
+                           pathIndex.bucket_count() * sizeof(void*) +
+                           pathIndex.size() * (sizeof(pair<const uint64_t, NodeId>) + sizeof(void*)) +
+                           (freeNodes.capacity() + freeBlobs.capacity()) * sizeof(uint32_t);
+            for (const File& f : blobs) bytes += f.compressed() ? f.memoryUsage() : f.content.memoryUsage() - f.content.size();
+            return bytes + storedBytes();
+        }
+};
@@ -0,0 +1,321 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "BlockStore.h"
+#include "File.h"
+
+using namespace std;
+
+
+// Spill space for file contents evicted under the memory budget (see FileSystem::setMemoryBudget).
+// A content is written to a scratch host file in fixed-size pages, and the file keeps the list of its
+// pages as a SpilledContent, so it reads and loads back like a file of a lazily opened snapshot.
+//
+// Pages read back go through a cache split into shards by page number, each an LRU list under its own
+// lock, so search and save workers reading spilled files at the same time rarely wait on each other.
+// Missing pages are read in runs, one pread() per stretch of consecutive pages, and a read that starts
+// where the previous one on the same file ended also brings in the READ_AHEAD pages after it.
+//
+// The scratch file is unlinked as soon as it is created. Spilled contents are part of the tree in
+// memory as far as the rest of the system is concerned: snapshots save them like any other content,
+// and nothing in the page store outlives the process.
+class PageStore : public enable_shared_from_this<PageStore> {
+    public:
+        static constexpr size_t PAGE = 4096;
+        static constexpr size_t READ_AHEAD = 32; // Pages past a sequential read, and most pages read at once
+        static constexpr size_t SHARDS = 16;
+        static constexpr size_t MIN_CACHE = 4 * READ_AHEAD; // Pages, so read-ahead doesn't evict the pages it is ahead of
+
+        struct Counters {
+            atomic<uint64_t> hits{0}, misses{0}, evictions{0}; // Pages found in the cache, read from disk, dropped from it
+            atomic<uint64_t> readAhead{0}; // Pages read before anyone asked for them
+            atomic<uint64_t> spilled{0}, pagedIn{0}; // Files written out, and loaded back by an edit
+        };
+
+    private:
+        using Page = shared_ptr<const string>;
+        using Entry = pair<uint32_t, Page>;
+
+        struct Shard {
+            mutex lock;
+            list<Entry> lru; // Most recently used first
+            unordered_map<uint32_t, list<Entry>::iterator> index;
+        };
+
+        int fd = -1;
+        atomic<size_t> shardPages{MIN_CACHE / SHARDS}; // Cache capacity of each shard
+        Shard shards[SHARDS];
+        mutex allocation; // Pages are freed by whichever thread drops the last copy of a file
+        vector<uint32_t> freePages; // Highest first, so the lowest is at the back
+        uint32_t pageCount = 0; // Pages in the file, free ones included
+        Counters counters;
+
+        Shard& shardOf(uint32_t page) { return shards[page % SHARDS]; }
+
+        Page cached(uint32_t page) {
+            Shard& s = shardOf(page);
+            lock_guard<mutex> guard(s.lock);
+            auto it = s.index.find(page);
+            if (it == s.index.end()) return nullptr;
+            s.lru.splice(s.lru.begin(), s.lru, it->second);
+            return it->second->second;
+        }
+
+        void insert(uint32_t page, Page bytes) {
+            Shard& s = shardOf(page);
+            lock_guard<mutex> guard(s.lock);
+            if (s.index.count(page)) return; // Another reader got there first
+            s.lru.emplace_front(page, move(bytes));
+            s.index[page] = s.lru.begin();
+            trim(s);
+        }
+
+        void trim(Shard& s) {
+            while (s.lru.size() > shardPages) {
+                s.index.erase(s.lru.back().first);
+                s.lru.pop_back();
+                counters.evictions++;
+            }
+        }
+
+        // Read pages[from, to) into out, one pread() per run of consecutive page numbers
+        bool readPages(const vector<uint32_t>& pages, size_t from, size_t to, vector<Page>& out) const {
+            string buffer;
+            for (size_t i = from; i < to;) {
+                size_t run = 1;
+                while (i + run < to && pages[i + run] == pages[i] + run) run++;
+                buffer.resize(run * PAGE);
+                if (!readAt(buffer.data(), buffer.size(), uint64_t(pages[i]) * PAGE)) return false;
+                for (size_t k = 0; k < run; k++) out.push_back(make_shared<const string>(buffer, k * PAGE, PAGE));
+                i += run;
+            }
+            return true;
+        }
+
+        bool readAt(char* data, size_t len, uint64_t offset) const {
+            while (len > 0) {
+                ssize_t n = pread(fd, data, len, offset);
+                if (n < 0) return false;
+                if (n == 0) { // Past the end of the file: the last page was never written in full
+                    memset(data, 0, len);
+                    return true;
+                }
+                data += n;
+                len -= n;
+                offset += n;
+            }
+            return true;
+        }
+
+        bool writeAt(const char* data, size_t len, uint64_t offset) {
+            while (len > 0) {
+                ssize_t n = pwrite(fd, data, len, offset);
+                if (n <= 0) return false;
+                data += n;
+                len -= n;
+                offset += n;
+            }
+            return true;
+        }
+
+        // Page numbers for a content of n pages: free ones first, lowest first, then new ones at the end
+        vector<uint32_t> allocate(size_t n) {
+            vector<uint32_t> pages;
+            pages.reserve(n);
+            lock_guard<mutex> guard(allocation);
+            while (pages.size() < n && !freePages.empty()) {
+                pages.push_back(freePages.back());
+                freePages.pop_back();
+            }
+            sort(pages.begin(), pages.end());
+            while (pages.size() < n) pages.push_back(pageCount++);
+            return pages;
+        }
+
+    public:
+        PageStore() = default;
+        PageStore(const PageStore&) = delete;
+        PageStore& operator=(const PageStore&) = delete;
+        ~PageStore() {
+            if (fd >= 0) ::close(fd);
+        }
+
+        // Create the scratch file at path (and unlink it right away); false if the host refuses
+        bool open(const string& path) {
+            fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+            if (fd < 0) return false;
+            unlink(path.c_str());
+            return true;
+        }
+
+        // Cache at most bytes of pages (at least MIN_CACHE pages)
+        void setCacheSize(size_t bytes) {
+            shardPages = max(MIN_CACHE, bytes / PAGE) / SHARDS;
+            for (Shard& s : shards) {
+                lock_guard<mutex> guard(s.lock);
+                trim(s);
+            }
+        }
+
+        // Write a file's content to fresh pages; nullptr if the write fails. Defined after SpilledContent.
+        shared_ptr<const StoredContent> spill(const File& file);
+
+        // Visit pages [first, last] of a content through the cache. With sequential set, a miss that
+        // reaches the last page also reads up to READ_AHEAD pages past it. False on a read error.
+        template <typename Visit>
+        bool forEachPage(const vector<uint32_t>& pages, size_t first, size_t last, bool sequential, Visit visit) {
+            vector<Page> window;
+            for (size_t i = first; i <= last;) {
+                size_t end = min(last + 1, i + READ_AHEAD);
+                window.clear();
+                for (size_t k = i; k < end; k++) {
+                    Page page = cached(pages[k]);
+                    if (page) {
+                        counters.hits++;
+                        window.push_back(move(page));
+                        continue;
+                    }
+                    size_t missing = k + 1; // The run of pages not in the cache, read in one go
+                    while (missing < end && !cached(pages[missing])) missing++;
+                    size_t ahead = sequential && missing == last + 1 ? min(pages.size(), missing + READ_AHEAD) : missing;
+                    size_t before = window.size();
+                    if (!readPages(pages, k, ahead, window)) return false;
+                    for (size_t j = k; j < ahead; j++) insert(pages[j], window[before + j - k]);
+                    counters.misses += missing - k;
+                    counters.readAhead += ahead - missing;
+                    window.resize(before + missing - k);
+                    k = missing - 1;
+                }
+                for (size_t k = i; k < end; k++) visit(k, string_view(*window[k - i]));
+                i = end;
+            }
+            return true;
+        }
+
+        // Whole content straight from the file, leaving the cache to the reads that come back
+        bool read(const vector<uint32_t>& pages, string& out) const {
+            vector<Page> all;
+            if (!readPages(pages, 0, pages.size(), all)) return false;
+            for (const Page& p : all) out.append(*p);
+            return true;
+        }
+
+        // Give the pages of a dropped content back (and drop them from the cache: they will be reused)
+        void release(const vector<uint32_t>& pages) {
+            for (uint32_t page : pages) {
+                Shard& s = shardOf(page);
+                lock_guard<mutex> guard(s.lock);
+                auto it = s.index.find(page);
+                if (it == s.index.end()) continue;
+                s.lru.erase(it->second);
+                s.index.erase(it);
+            }
+            lock_guard<mutex> guard(allocation);
+            freePages.insert(freePages.end(), pages.begin(), pages.end());
+            sort(freePages.rbegin(), freePages.rend());
+        }
+
+        Counters& stats() { return counters; }
+
+        // Pages holding contents, and all pages in the file
+        pair<size_t, size_t> pagesInUse() {
+            lock_guard<mutex> guard(allocation);
+            return {pageCount - freePages.size(), pageCount};
+        }
+
+        size_t cachedPages() {
+            size_t n = 0;
+            for (Shard& s : shards) {
+                lock_guard<mutex> guard(s.lock);
+                n += s.lru.size();
+            }
+            return n;
+        }
+};
+
+
+// Content of a file spilled to a PageStore. Immutable like the other content forms, so copies of the
+// tree (a checkpoint's, say) share it; the pages go back to the store with the last copy.
+class SpilledContent : public StoredContent {
+    private:
+        shared_ptr<PageStore> store;
+        vector<uint32_t> pages;
+        size_t length;
+        mutable atomic<uint64_t> nextRead{UINT64_MAX}; // Where the last read ended, to spot sequential ones
+
+    public:
+        SpilledContent(shared_ptr<PageStore> store, vector<uint32_t> pages, size_t length)
+            : store(move(store)), pages(move(pages)), length(length) {}
+        ~SpilledContent() override { store->release(pages); }
+
+        size_t size() const override { return length; }
+
+        string bytes() const override {
+            string out;
+            out.reserve(pages.size() * PageStore::PAGE);
+            if (!store->read(pages, out)) cerr << "Error: Cannot read spilled content back." << endl;
+            out.resize(length);
+            return out;
+        }
+
+        Rope load() const override {
+            store->stats().pagedIn++;
+            return BlockStore::instance().build(string_view(bytes())); // Shares blocks with other files again
+        }
+
+        void forEachPiece(uint64_t from, uint64_t count, const function<void(string_view)>& visit) const override {
+            uint64_t end = min<uint64_t>(length, from + count);
+            if (from >= end) return;
+            bool sequential = nextRead.exchange(end) == from;
+            bool ok = store->forEachPage(pages, from / PageStore::PAGE, (end - 1) / PageStore::PAGE, sequential, [&](size_t i, string_view page) {
+                uint64_t at = uint64_t(i) * PageStore::PAGE;
+                uint64_t skip = from > at ? from - at : 0;
+                visit(page.substr(skip, min<uint64_t>(page.size(), end - at) - skip));
+            });
+            if (!ok) cerr << "Error: Cannot read spilled content back." << endl;
+        }
+};
+
+
+inline shared_ptr<const StoredContent> PageStore::spill(const File& file) {
+    size_t length = file.size();
+    vector<uint32_t> pages = allocate((length + PAGE - 1) / PAGE);
+    auto content = make_shared<const SpilledContent>(shared_from_this(), pages, length); // Frees the pages if anything fails
+    string buffer; // Pages of a run of consecutive numbers, written together
+    size_t first = 0, done = 0; // First page in buffer, pages written
+    bool ok = true;
+    auto flush = [&] {
+        if (buffer.empty()) return;
+        ok = ok && writeAt(buffer.data(), buffer.size(), uint64_t(pages[first]) * PAGE);
+        done += (buffer.size() + PAGE - 1) / PAGE;
+        buffer.clear();
+    };
+    file.forEachPiece(0, length, [&](string_view piece) {
+        while (!piece.empty()) {
+            size_t page = done + buffer.size() / PAGE;
+            if (buffer.size() % PAGE == 0 && !buffer.empty() && (pages[page] != pages[page - 1] + 1 || buffer.size() >= READ_AHEAD * PAGE)) {
+                flush();
+                first = page;
+            }
+            size_t take = min(piece.size(), PAGE - buffer.size() % PAGE);
+            buffer.append(piece.substr(0, take));
+            piece.remove_prefix(take);
+        }
+    }, cerr); // Spills run between commands, with no command to report to
+    flush();
+    if (!ok) return nullptr;
+    counters.spilled++;
+    return content;
+}
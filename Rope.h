@@ -0,0 +1,188 @@
+#pragma once
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+#include <utility>
+
+using namespace std;
+
+
+// Piece-table content engine used by File.
+// Text lives in immutable shared buffers; the file is an ordered sequence of pieces
+// (buffer, offset, length) kept in a persistent treap keyed by position, so every
+// splice is a couple of O(log n) split/merge operations instead of a full copy.
+// Nodes are never modified after creation, which makes copies and views O(1).
+class Rope {
+    private:
+        struct Piece {
+            shared_ptr<const string> buffer; // Shared buffer holding the text of this piece
+            size_t offset; // Start of the piece inside the buffer
+            size_t length; // Number of bytes in the piece
+            size_t total; // Bytes in the whole subtree rooted at this piece
+            size_t count; // Pieces in the whole subtree rooted at this piece
+            uint32_t priority; // Treap priority (max-heap) keeping the tree balanced
+            shared_ptr<const Piece> left, right; // Pieces before and after this one
+        };
+        using Node = shared_ptr<const Piece>;
+
+        Node root; // Root of the treap (nullptr for empty content)
+
+        static size_t sizeOf(const Node& n) { return n ? n->total : 0; }
+        static size_t countOf(const Node& n) { return n ? n->count : 0; }
+
+        static uint32_t nextPriority() {
+            thread_local mt19937 rng(random_device{}()); // One generator per thread, no locking needed
+            return rng();
+        }
+
+        static Node make(shared_ptr<const string> buffer, size_t offset, size_t length, uint32_t priority, Node left, Node right) {
+            size_t total = sizeOf(left) + length + sizeOf(right);
+            size_t count = countOf(left) + 1 + countOf(right);
+            return make_shared<const Piece>(Piece{move(buffer), offset, length, total, count, priority, move(left), move(right)});
+        }
+
+        static Node withChildren(const Node& n, Node left, Node right) {
+            return make(n->buffer, n->offset, n->length, n->priority, move(left), move(right)); // Path copy of one node
+        }
+
+        static Node leaf(shared_ptr<const string> buffer, size_t offset, size_t length) {
+            if (length == 0) return nullptr;
+            return make(move(buffer), offset, length, nextPriority(), nullptr, nullptr);
+        }
+
+        static Node merge(const Node& a, const Node& b) {
+            if (!a) return b;
+            if (!b) return a;
+            if (a->priority > b->priority) return withChildren(a, a->left, merge(a->right, b));
+            return withChildren(b, merge(a, b->left), b->right);
+        }
+
+        // Split into [0, pos) and [pos, size), cutting a piece in two if pos falls inside it
+        static pair<Node, Node> split(const Node& n, size_t pos) {
+            if (!n) return {nullptr, nullptr};
+            size_t leftSize = sizeOf(n->left);
+            if (pos <= leftSize) {
+                auto parts = split(n->left, pos);
+                return {parts.first, withChildren(n, parts.second, n->right)};
+            }
+            if (pos >= leftSize + n->length) {
+                auto parts = split(n->right, pos - leftSize - n->length);
+                return {withChildren(n, n->left, parts.first), parts.second};
+            }
+            size_t cut = pos - leftSize; // Cut point inside this piece
+            Node head = leaf(n->buffer, n->offset, cut);
+            Node tail = leaf(n->buffer, n->offset + cut, n->length - cut);
+            return {merge(n->left, head), merge(tail, n->right)};
+        }
+
+        template <typename Visitor>
+        static void visit(const Node& n, size_t start, size_t end, Visitor& visitor) {
+            if (!n || start >= end) return;
+            size_t leftSize = sizeOf(n->left);
+            if (start < leftSize) visit(n->left, start, min(end, leftSize), visitor);
+            size_t pieceEnd = leftSize + n->length;
+            if (start < pieceEnd && end > leftSize) {
+                size_t from = max(start, leftSize) - leftSize;
+                size_t to = min(end, pieceEnd) - leftSize;
+                visitor(string_view(n->buffer->data() + n->offset + from, to - from));
+            }
+            if (end > pieceEnd) visit(n->right, start > pieceEnd ? start - pieceEnd : 0, end - pieceEnd, visitor);
+        }
+
+        template <typename Visitor>
+        static void forEachBuffer(const Node& n, Visitor& visitor) {
+            if (!n) return;
+            forEachBuffer(n->left, visitor);
+            visitor(n->buffer);
+            forEachBuffer(n->right, visitor);
+        }
+
+    public:
+        // Read-only window over a rope; keeps its own reference to the tree so later edits don't affect it
+        class View {
+            private:
+                Node root; // Snapshot of the tree the view was taken from
+                size_t start, length; // Range covered by the view
+            public:
+                View(Node root = nullptr, size_t start = 0, size_t length = 0) : root(move(root)), start(start), length(length) {}
+
+                size_t size() const { return length; }
+                bool empty() const { return length == 0; }
+
+                // Part of this view, [from, from + count) relative to its start
+                View slice(size_t from, size_t count) const { return View(root, start + from, count); }
+
+                template <typename Visitor>
+                void forEachPiece(Visitor visitor) const { visit(root, start, start + length, visitor); }
+
+                string str() const {
+                    string out;
+                    out.reserve(length);
+                    forEachPiece([&](string_view piece) { out.append(piece); });
+                    return out;
+                }
+
+                friend ostream& operator<<(ostream& os, const View& v) {
+                    v.forEachPiece([&](string_view piece) { os.write(piece.data(), piece.size()); });
+                    return os;
+                }
+        };
+
+        Rope() = default;
+        Rope(string text) {
+            size_t length = text.size();
+            root = leaf(make_shared<const string>(move(text)), 0, length); // Take over the buffer, no copy
+        }
+
+        size_t size() const { return sizeOf(root); }
+        bool empty() const { return !root; }
+        size_t pieces() const { return countOf(root); }
+
+        // Approximate heap footprint: content bytes plus one treap node (and its control block) per piece
+        size_t memoryUsage() const { return size() + pieces() * (sizeof(Piece) + 2 * sizeof(long)); }
+
+        // Replace `count` bytes at `pos` with `text` (count is clamped to the end of the content)
+        void replace(size_t pos, size_t count, const string& text) {
+            auto head = split(root, pos);
+            auto tail = split(head.second, count);
+            Node middle = leaf(make_shared<const string>(text), 0, text.size());
+            root = merge(merge(head.first, middle), tail.second);
+        }
+
+        void append(const string& text) { root = merge(root, leaf(make_shared<const string>(text), 0, text.size())); }
+
+        // Append a shared immutable buffer as one piece, without copying it (used for deduplicated blocks)
+        void appendShared(shared_ptr<const string> buffer) {
+            size_t length = buffer->size();
+            root = merge(root, leaf(move(buffer), 0, length));
+        }
+        void insert(size_t pos, const string& text) { replace(pos, 0, text); }
+
+        void erase(size_t pos, size_t count) {
+            auto head = split(root, pos);
+            root = merge(head.first, split(head.second, count).second);
+        }
+
+        // Cut [start, start + count) out and reinsert it at `target` (an offset in the content without that range)
+        void relocate(size_t start, size_t count, size_t target) {
+            auto head = split(root, start);
+            auto cut = split(head.second, count);
+            auto rest = split(merge(head.first, cut.second), target);
+            root = merge(merge(rest.first, cut.first), rest.second);
+        }
+
+        void truncate(size_t maxSize) { root = split(root, maxSize).first; } // Pieces past maxSize are simply dropped
+
+        // Every buffer the pieces point into, once per piece (so possibly more than once per buffer)
+        template <typename Visitor>
+        void forEachBuffer(Visitor visitor) const { forEachBuffer(root, visitor); }
+
+        View view(size_t start, size_t count) const { return View(root, start, count); }
+        View view() const { return View(root, 0, size()); }
+
+        string str() const { return view().str(); }
+
+        friend ostream& operator<<(ostream& os, const Rope& r) { return os << r.view(); }
+};
@@ -0,0 +1,124 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include "Rope.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FS_SEARCH_X86 1
+#endif
+
+using namespace std;
+
+
+// Substring search kernels. All of them return the first position >= from where needle occurs in
+// hay, or string_view::npos. The vector kernels compare the needle's first and last bytes against a
+// whole block of candidate positions at once and only memcmp the positions where both match, which
+// for text is a tiny fraction.
+namespace search {
+
+    inline size_t findScalar(string_view hay, string_view needle, size_t from) {
+        return hay.find(needle, from);
+    }
+
+#ifdef FS_SEARCH_X86
+    // Check every candidate bit of mask (position i + bit) against the middle of the needle
+    inline size_t verify(const char* hay, size_t i, uint32_t mask, string_view needle) {
+        while (mask) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (memcmp(hay + pos + 1, needle.data() + 1, needle.size() - 2) == 0) return pos;
+            mask &= mask - 1;
+        }
+        return string_view::npos;
+    }
+
+    inline size_t findSSE2(string_view hay, string_view needle, size_t from) {
+        size_t n = needle.size();
+        if (n < 2 || hay.size() < n) return findScalar(hay, needle, from);
+        const char* h = hay.data();
+        __m128i first = _mm_set1_epi8(needle[0]), last = _mm_set1_epi8(needle[n - 1]);
+        size_t i = from;
+        for (; i + n - 1 + 16 <= hay.size(); i += 16) {
+            __m128i blockFirst = _mm_loadu_si128((const __m128i*)(h + i));
+            __m128i blockLast = _mm_loadu_si128((const __m128i*)(h + i + n - 1));
+            uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, blockFirst), _mm_cmpeq_epi8(last, blockLast)));
+            size_t pos = verify(h, i, mask, needle);
+            if (pos != string_view::npos) return pos;
+        }
+        return findScalar(hay, needle, i); // Fewer than 16 candidates left
+    }
+
+    __attribute__((target("avx2"))) inline size_t findAVX2(string_view hay, string_view needle, size_t from) {
+        size_t n = needle.size();
+        if (n < 2 || hay.size() < n) return findScalar(hay, needle, from);
+        const char* h = hay.data();
+        __m256i first = _mm256_set1_epi8(needle[0]), last = _mm256_set1_epi8(needle[n - 1]);
+        size_t i = from;
+        for (; i + n - 1 + 32 <= hay.size(); i += 32) {
+            __m256i blockFirst = _mm256_loadu_si256((const __m256i*)(h + i));
+            __m256i blockLast = _mm256_loadu_si256((const __m256i*)(h + i + n - 1));
+            uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, blockFirst), _mm256_cmpeq_epi8(last, blockLast)));
+            size_t pos = verify(h, i, mask, needle);
+            if (pos != string_view::npos) return pos;
+        }
+        return findSSE2(hay, needle, i);
+    }
+#endif
+
+    using Kernel = size_t (*)(string_view, string_view, size_t);
+
+    // Widest kernel this CPU supports, picked once
+    inline Kernel bestKernel() {
+#ifdef FS_SEARCH_X86
+        if (__builtin_cpu_supports("avx2")) return findAVX2;
+        return findSSE2;
+#else
+        return findScalar;
+#endif
+    }
+
+    inline const char* kernelName() {
+#ifdef FS_SEARCH_X86
+        return __builtin_cpu_supports("avx2") ? "AVX2" : "SSE2";
+#else
+        return "scalar";
+#endif
+    }
+
+    // Call found(offset) for every occurrence of needle in the content, overlapping ones included, in
+    // order. Pieces are searched in place; a match that straddles pieces is caught in a small window
+    // made of the last needle - 1 bytes seen and the start of the next piece, and reported exactly once,
+    // by the piece it ends in.
+    template <typename Found>
+    void forEachMatch(const Rope::View& content, string_view needle, Found found) {
+        static const Kernel find = bestKernel();
+        size_t n = needle.size();
+        if (n == 0) return;
+        string carry; // Up to n - 1 bytes before the current piece
+        size_t base = 0; // Offset of the current piece in the content
+        content.forEachPiece([&](string_view piece) {
+            if (!carry.empty()) {
+                string window = carry;
+                window.append(piece.substr(0, n - 1));
+                for (size_t pos = find(window, needle, 0); pos != string_view::npos && pos < carry.size();
+                     pos = find(window, needle, pos + 1)) {
+                    if (pos + n > carry.size()) found(base - carry.size() + pos);
+                }
+            }
+            for (size_t pos = find(piece, needle, 0); pos != string_view::npos; pos = find(piece, needle, pos + 1)) {
+                found(base + pos);
+            }
+            if (n > 1) {
+                if (piece.size() >= n - 1) {
+                    carry.assign(piece.substr(piece.size() - (n - 1)));
+                } else {
+                    carry.append(piece);
+                    if (carry.size() > n - 1) carry.erase(0, carry.size() - (n - 1));
+                }
+            }
+            base += piece.size();
+        });
+    }
+}
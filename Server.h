@@ -0,0 +1,379 @@
+#pragma once
+#include <cerrno>
+#include <condition_variable>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "CommandUtils.h"
+
+using namespace std;
+
+
+// Wire format, both ways over a Unix-domain stream socket: the client sends command lines, and every
+// line gets one reply, "OK <n>\n" or "ERR <n>\n" (the command failed) followed by the n bytes the
+// command printed.
+namespace wire {
+    inline bool sendAll(int fd, const string& bytes) {
+        for (size_t sent = 0; sent < bytes.size();) {
+            ssize_t n = send(fd, bytes.data() + sent, bytes.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            sent += n;
+        }
+        return true;
+    }
+
+    inline string reply(bool ok, const string& output) {
+        return (ok ? "OK " : "ERR ") + to_string(output.size()) + '\n' + output;
+    }
+
+    inline bool address(const string& path, sockaddr_un& addr) {
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(addr.sun_path)) return false;
+        memcpy(addr.sun_path, path.data(), path.size());
+        return true;
+    }
+}
+
+
+// One connection to a server, running one command at a time
+class Client {
+    private:
+        int fd = -1;
+        string buffer; // Received past the last reply
+
+        // Read until buffer holds n bytes
+        bool fill(size_t n) {
+            char chunk[1 << 16];
+            while (buffer.size() < n) {
+                ssize_t got = recv(fd, chunk, sizeof(chunk), 0);
+                if (got < 0 && errno == EINTR) continue;
+                if (got <= 0) return false;
+                buffer.append(chunk, got);
+            }
+            return true;
+        }
+
+    public:
+        Client() = default;
+        Client(const Client&) = delete;
+        Client& operator=(const Client&) = delete;
+        ~Client() {
+            if (fd >= 0) ::close(fd);
+        }
+
+        bool connect(const string& path) {
+            sockaddr_un addr;
+            if (!wire::address(path, addr)) return false;
+            fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            return fd >= 0 && ::connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0;
+        }
+
+        // Run one command line: output gets what it printed and ok whether it succeeded. False if the
+        // connection is gone (the server also closes it after exit).
+        bool call(const string& line, string& output, bool& ok) {
+            if (!wire::sendAll(fd, line + '\n')) return false;
+            size_t header;
+            while ((header = buffer.find('\n')) == string::npos) {
+                if (!fill(buffer.size() + 1)) return false;
+            }
+            ok = buffer.compare(0, 3, "OK ") == 0;
+            if (!ok && buffer.compare(0, 4, "ERR ") != 0) return false; // Not a reply header
+            size_t start = ok ? 3 : 4;
+            string digits = buffer.substr(start, header - start);
+            if (digits.empty() || digits.size() > 18 || digits.find_first_not_of("0123456789") != string::npos) return false;
+            size_t length = stoul(digits);
+            if (!fill(header + 1 + length)) return false;
+            output.assign(buffer, header + 1, length);
+            buffer.erase(0, header + 1 + length);
+            return true;
+        }
+};
+
+
+// Serves one FileSystem to local clients (see wire above). Each connection is a session with its own
+// current directory and descriptors (FileSystem::Session).
+//
+// One thread polls the listening socket and the idle connections. A connection with a whole line to
+// run is queued for a fixed pool of workers; the worker runs every line it has and hands it back to
+// the poller. A connection is on one thread at a time, so its commands run in the order sent, while
+// those of different connections run side by side under the tree and file locks of FileSystem.
+class Server {
+    private:
+        struct Connection {
+            int fd;
+            FileSystem::Session session;
+            string input; // Received, not yet run
+            bool busy = false; // Queued or with a worker; the poller leaves it alone
+            bool closing = false; // The client hung up or sent exit: close it once it is handed back
+        };
+
+        FileSystem& fs;
+        string path;
+        size_t workerCount;
+        int listener = -1;
+        int wake[2] = {-1, -1}; // Workers write back the socket of a connection they are done with, -1 to stop
+        unordered_map<int, unique_ptr<Connection>> connections; // By socket; the poller's alone
+        vector<thread> workers;
+        mutex lock;
+        condition_variable ready;
+        deque<Connection*> queue; // Connections with lines to run
+        bool stopping = false;
+        function<void()> timer; // Run by the poller every timerPeriod, see every()
+        chrono::steady_clock::duration timerPeriod{};
+
+        static inline int stopSignal = -1; // wake[1], for the signal handler
+
+        static void onSignal(int) {
+            int stop = -1;
+            if (write(stopSignal, &stop, sizeof(stop)) < 0) {} // Nothing to do about it in a handler
+        }
+
+        void work() {
+            while (true) {
+                Connection* c;
+                {
+                    unique_lock<mutex> guard(lock);
+                    ready.wait(guard, [&] { return stopping || !queue.empty(); });
+                    if (queue.empty()) return;
+                    c = queue.front();
+                    queue.pop_front();
+                }
+                serve(*c);
+                int fd = c->fd; // The poller may drop c as soon as it reads this
+                if (write(wake[1], &fd, sizeof(fd)) < 0) cerr << "Server: cannot hand a connection back.\n";
+            }
+        }
+
+        // Run the whole lines a connection has, each with its reply
+        void serve(Connection& c) {
+            FileSystem::enterSession(&c.session);
+            size_t start = 0, end;
+            while ((end = c.input.find('\n', start)) != string::npos) {
+                string line = c.input.substr(start, end - start);
+                start = end + 1;
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                ostringstream output;
+                c.session.out = &output;
+                fs.resetStatus();
+                bool keepGoing = runCommand(fs, line);
+                fs.endSharedCommand();
+                fs.syncCommand(); // Outside the locks: an OK reply means the change is on disk
+                if (!wire::sendAll(c.fd, wire::reply(!fs.commandFailed(), output.str())) || !keepGoing) {
+                    c.closing = true;
+                    start = c.input.size(); // Whatever else it sent is dropped with it
+                    break;
+                }
+            }
+            c.input.erase(0, start);
+            c.session.out = &cout;
+            if (c.closing) fs.endSession();
+            FileSystem::enterSession(nullptr);
+        }
+
+        void accept() {
+            int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) return;
+            auto c = make_unique<Connection>();
+            c->fd = fd;
+            c->session.hostPaths = false; // Host files are the server's, not the client's
+            connections[fd] = move(c);
+        }
+
+        // Take what an idle connection sent; queue it once it has a whole line (or hung up)
+        void receive(Connection& c) {
+            char chunk[1 << 16];
+            ssize_t n = recv(c.fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+            if (n > 0) {
+                c.input.append(chunk, n);
+                if (c.input.find('\n', c.input.size() - n) == string::npos) return;
+            } else {
+                c.closing = true; // The last line may lack its newline, like a script's
+                if (!c.input.empty() && c.input.back() != '\n') c.input += '\n';
+            }
+            c.busy = true;
+            {
+                lock_guard<mutex> guard(lock);
+                queue.push_back(&c);
+            }
+            ready.notify_one();
+        }
+
+        void drop(int fd) {
+            ::close(fd);
+            connections.erase(fd);
+        }
+
+    public:
+        Server(FileSystem& fs, const string& path, size_t workers)
+            : fs(fs), path(path), workerCount(max<size_t>(1, workers)) {}
+
+        ~Server() {
+            if (listener >= 0) {
+                ::close(listener);
+                unlink(path.c_str());
+            }
+            for (int fd : wake) {
+                if (fd >= 0) ::close(fd);
+            }
+        }
+
+        // Listen at path, replacing a socket left there by a server that is gone. Reports the failure.
+        bool start() {
+            sockaddr_un addr;
+            if (!wire::address(path, addr)) {
+                cerr << "Server: socket path must be 1 to " << sizeof(addr.sun_path) - 1 << " bytes: " << path << '\n';
+                return false;
+            }
+            struct stat st;
+            if (stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+                Client probe;
+                if (probe.connect(path)) {
+                    cerr << "Server: another server is listening on " << path << '\n';
+                    return false;
+                }
+                unlink(path.c_str());
+            }
+            // Owner only: nothing can connect before listen(), so the socket is never open to other users
+            listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (listener < 0 || bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0 || chmod(path.c_str(), 0600) != 0 ||
+                listen(listener, SOMAXCONN) != 0) {
+                cerr << "Server: cannot listen on " << path << ": " << strerror(errno) << '\n';
+                if (listener >= 0) ::close(listener);
+                listener = -1;
+                return false;
+            }
+            if (pipe2(wake, O_CLOEXEC) != 0) {
+                cerr << "Server: " << strerror(errno) << '\n';
+                return false;
+            }
+            fs.setShared();
+            return true;
+        }
+
+        // Have the poller run task every seconds while serving (before run())
+        void every(double seconds, function<void()> task) {
+            timerPeriod = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(seconds));
+            timer = move(task);
+        }
+
+        // Make run() return, from any thread
+        void stop() {
+            int stop = -1;
+            if (write(wake[1], &stop, sizeof(stop)) < 0) cerr << "Server: cannot stop.\n";
+        }
+
+        // Serve until SIGINT or SIGTERM (or stop()); the sessions still connected are closed after the commands they
+        // already sent
+        void run() {
+            stopSignal = wake[1];
+            struct sigaction action = {};
+            action.sa_handler = onSignal;
+            sigaction(SIGINT, &action, nullptr);
+            sigaction(SIGTERM, &action, nullptr);
+            for (size_t i = 0; i < workerCount; i++) workers.emplace_back([this] { work(); });
+            cerr << "Serving on " << path << " with " << workerCount << " workers\n";
+
+            vector<pollfd> polled;
+            bool running = true;
+            auto nextTick = chrono::steady_clock::now() + timerPeriod;
+            while (running) {
+                int timeout = -1; // Milliseconds to the next timer run, -1 for none
+                if (timer) {
+                    if (chrono::steady_clock::now() >= nextTick) {
+                        timer();
+                        nextTick = chrono::steady_clock::now() + timerPeriod;
+                    }
+                    timeout = chrono::ceil<chrono::milliseconds>(nextTick - chrono::steady_clock::now()).count();
+                }
+                polled.assign({{listener, POLLIN, 0}, {wake[0], POLLIN, 0}});
+                for (const auto& [fd, c] : connections) {
+                    if (!c->busy) polled.push_back({fd, POLLIN, 0});
+                }
+                if (poll(polled.data(), polled.size(), timeout) < 0) {
+                    if (errno == EINTR) continue;
+                    cerr << "Server: " << strerror(errno) << '\n';
+                    break;
+                }
+                if (polled[1].revents & POLLIN) {
+                    int handed[64];
+                    ssize_t n = read(wake[0], handed, sizeof(handed));
+                    for (ssize_t i = 0; i < n / ssize_t(sizeof(int)); i++) {
+                        if (handed[i] < 0) {
+                            running = false;
+                            continue;
+                        }
+                        Connection& c = *connections[handed[i]];
+                        c.busy = false;
+                        if (c.closing) drop(c.fd);
+                    }
+                }
+                if (polled[0].revents & POLLIN) accept();
+                for (size_t i = 2; i < polled.size(); i++) {
+                    if (!polled[i].revents) continue;
+                    auto it = connections.find(polled[i].fd);
+                    if (it != connections.end() && !it->second->busy) receive(*it->second);
+                }
+            }
+
+            {
+                lock_guard<mutex> guard(lock);
+                stopping = true;
+            }
+            ready.notify_all();
+            for (thread& t : workers) t.join();
+            workers.clear();
+            while (!connections.empty()) drop(connections.begin()->first);
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTERM, SIG_DFL);
+        }
+};
+
+
+// --connect: send each line of in to the server at path and print the output of its reply. Like batch
+// mode, blank lines and # comments are skipped, and with failFast the first failed command stops it.
+// Returns the exit status: 0, 1 after a failed command with failFast, 2 if the server is unreachable.
+inline int runClient(const string& path, istream& in, bool failFast) {
+    Client client;
+    if (!client.connect(path)) {
+        cerr << "Cannot connect to " << path << '\n';
+        return 2;
+    }
+    string line, output;
+    size_t lineNumber = 0;
+    while (getline(in, line)) {
+        lineNumber++;
+        if (line.empty() || line[0] == '#') continue;
+        bool ok;
+        if (!client.call(line, output, ok)) {
+            cerr << "Connection to " << path << " lost\n";
+            return 2;
+        }
+        cout << output;
+        if (failFast && !ok) {
+            cout.flush();
+            cerr << "Stopped at line " << lineNumber << ": " << line << '\n';
+            return 1;
+        }
+        if (line == "exit") break;
+    }
+    return 0;
+}
@@ -0,0 +1,720 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "BlockStore.h"
+#include "NodeArena.h"
+#include "ThreadPool.h"
+
+using namespace std;
+
+
+// Read-only memory mapping of a whole host file (unmapped when destroyed)
+class MappedFile {
+    private:
+        const char* data_ = nullptr; // Start of the mapping
+        size_t size_ = 0; // Length of the mapping
+    public:
+        MappedFile(const string& filename) {
+            int fd = open(filename.c_str(), O_RDONLY);
+            if (fd < 0) return;
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size > 0) {
+                void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    data_ = static_cast<const char*>(p);
+                    size_ = st.st_size;
+                }
+            }
+            close(fd); // The mapping stays valid after the descriptor is closed
+        }
+        ~MappedFile() { if (data_) munmap(const_cast<char*>(data_), size_); }
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        bool ok() const { return data_ != nullptr; }
+        const char* data() const { return data_; }
+        size_t size() const { return size_; }
+
+        // Tell the kernel how a range will be used (madvise), e.g. MADV_DONTNEED once it was read: pages
+        // of a read-only mapping are dropped and come back from the file if touched again
+        void advise(int advice, size_t offset = 0, size_t length = SIZE_MAX) const {
+            if (!data_ || offset >= size_) return;
+            size_t page = sysconf(_SC_PAGESIZE);
+            size_t start = offset / page * page; // madvise wants a page-aligned start
+            length = min(length, size_ - offset) + (offset - start);
+            madvise(const_cast<char*>(data_) + start, length, advice);
+        }
+};
+
+
+// Binary snapshot of the whole tree. All integers are little-endian.
+//
+//   header   magic "FSSNAP\0\0", version, then count and offset of each section
+//   strings  every distinct name once, as u32 length + bytes
+//   nodes    fixed-size records in pre-order; node 0 is the root and each record names its parent
+//   blocks   (offset, length) of every distinct content block in the blob region
+//   refs     u32 block indexes; each file is a run of them, addressed by (first, count) from its record
+//   totals   per node: bytes, files and directories below it (files: their size), in node order
+//   blobs    the bytes of each distinct block, once, back to back
+//
+// Contents are split with the same content-defined chunker as the block store, so a region shared by
+// many files (or repeated inside one) is written and read once. A directory record holds the index
+// just past its subtree, so the entries of any directory can be listed without reading the records
+// below them: openLazy() loads one directory at a time, as it is used, and save() copies the records
+// and blocks of directories nobody opened straight from the old snapshot. Names are addressed by
+// their byte offset in the string table, so none has to be read before it is needed. The totals give
+// the size of a directory nobody opened without reading its subtree.
+//
+// Version 1 (every file one blob range) and version 2 (names by index, no subtree extents) still load,
+// eagerly; version 3 (no totals) loads lazily, its totals summed up in one pass when it is opened.
+// Names and contents are length-prefixed, so spaces and newlines survive a round trip.
+class Snapshot {
+    private:
+        static constexpr char MAGIC[8] = {'F', 'S', 'S', 'N', 'A', 'P', '\0', '\0'};
+        static constexpr uint32_t VERSION = 4;
+        static constexpr uint32_t KIND_DIR = 0, KIND_FILE = 1;
+
+        struct Header {
+            char magic[8];
+            uint32_t version;
+            uint32_t journalGen; // First journal generation not folded into this snapshot
+            uint64_t stringCount, stringOffset; // String table
+            uint64_t nodeCount, nodeOffset; // Node table
+            uint64_t blobOffset, blobSize; // Content blobs
+            // Version 2 and later
+            uint64_t blockCount, blockOffset; // Block table
+            uint64_t refCount, refOffset; // Block references of all files
+            // Version 4 and later
+            uint64_t totalOffset; // Totals of every node
+        };
+        static constexpr size_t HEADER_V1 = offsetof(Header, blockCount);
+        static constexpr size_t HEADER_V2 = offsetof(Header, totalOffset);
+        static_assert(sizeof(Totals) == 16, "Totals are written as they are");
+
+        struct NodeRecord {
+            uint32_t kind; // KIND_DIR or KIND_FILE
+            uint32_t name; // Byte offset of the name in the string table (versions 1 and 2: its index)
+            uint32_t parent; // Index of the parent node (always a directory that comes earlier)
+            uint32_t reserved;
+            uint64_t contentStart, contentCount; // Files: range of block references (version 1: blob range)
+                                                 // Directories: index past the subtree, entries directly inside
+        };
+
+        struct BlockRecord {
+            uint64_t offset, length; // Range in the blob region
+        };
+
+        // Read and check the header of a mapped snapshot; prints why it is unusable to err when it is
+        static bool readHeader(const MappedFile& map, const string& filename, Header& h, ostream& err) {
+            const char* base = map.data();
+            size_t size = map.size();
+            h = Header{};
+            if (size < HEADER_V1) return corrupt(filename, err);
+            memcpy(&h, base, HEADER_V1);
+            if (memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0) return corrupt(filename, err);
+            if (h.version < 1 || h.version > VERSION) {
+                err << "Unsupported snapshot version " << h.version << " in " << filename << ".\n";
+                return false;
+            }
+            if (h.version >= 2) {
+                size_t length = h.version >= 4 ? sizeof(h) : HEADER_V2;
+                if (size < length) return corrupt(filename, err);
+                memcpy(&h, base, length);
+            }
+            if (h.stringOffset > h.nodeOffset || h.nodeOffset > size || h.blobOffset > size || h.blobSize > size - h.blobOffset ||
+                h.stringCount > size || h.nodeCount == 0 || h.nodeCount > (size - h.nodeOffset) / sizeof(NodeRecord) ||
+                h.nodeCount >= NOT_STORED) {
+                return corrupt(filename, err);
+            }
+            if (h.version >= 2 && (h.blockOffset > size || h.blockCount > (size - h.blockOffset) / sizeof(BlockRecord) ||
+                                   h.refOffset > size || h.refCount > (size - h.refOffset) / sizeof(uint32_t))) {
+                return corrupt(filename, err);
+            }
+            if (h.version >= 4 && (h.totalOffset > size || h.nodeCount > (size - h.totalOffset) / sizeof(Totals))) {
+                return corrupt(filename, err);
+            }
+            return true;
+        }
+
+        // A mapped version 3 or later snapshot that stub directories and not yet loaded files read from. Shared by
+        // every tree (and copy of a tree) opened from it, and kept mapped for as long as any of them needs
+        // it: replacing the file on disk doesn't affect a mapping.
+        class StoredTree : public NodeArena::LazySource, public enable_shared_from_this<StoredTree> {
+            public:
+                string filename;
+                MappedFile map;
+                Header h;
+                vector<Totals> summed; // Version 3: the totals the file doesn't hold, see sumTotals()
+
+                explicit StoredTree(const string& filename) : filename(filename), map(filename) {}
+
+                NodeRecord record(uint64_t i) const {
+                    NodeRecord r;
+                    memcpy(&r, map.data() + h.nodeOffset + i * sizeof(NodeRecord), sizeof(r));
+                    return r;
+                }
+
+                bool name(uint64_t at, string_view& out) const {
+                    uint64_t table = h.nodeOffset - h.stringOffset;
+                    uint32_t len;
+                    if (at > table || table - at < sizeof(len)) return false;
+                    memcpy(&len, map.data() + h.stringOffset + at, sizeof(len));
+                    if (len > table - at - sizeof(len)) return false;
+                    out = string_view(map.data() + h.stringOffset + at + sizeof(len), len);
+                    return true;
+                }
+
+                // Block index of reference k, and the block's place in the blob region
+                bool block(uint64_t k, uint32_t& index, BlockRecord& b) const {
+                    if (k >= h.refCount) return false;
+                    memcpy(&index, map.data() + h.refOffset + k * sizeof(uint32_t), sizeof(index));
+                    if (index >= h.blockCount) return false;
+                    memcpy(&b, map.data() + h.blockOffset + uint64_t(index) * sizeof(BlockRecord), sizeof(b));
+                    return b.offset <= h.blobSize && b.length <= h.blobSize - b.offset;
+                }
+
+                const char* blobs() const { return map.data() + h.blobOffset; }
+
+                Totals totals(uint64_t i) const {
+                    if (h.version < 4) return summed[i];
+                    Totals t;
+                    memcpy(&t, map.data() + h.totalOffset + i * sizeof(Totals), sizeof(t));
+                    return t;
+                }
+
+                // Totals of a version 3 snapshot, children before parents in one backward pass. Bad
+                // references count as empty; expand() reports them when the file is reached.
+                bool sumTotals() {
+                    summed.assign(h.nodeCount, Totals());
+                    uint32_t index;
+                    BlockRecord b;
+                    for (uint64_t i = h.nodeCount; i-- > 1;) {
+                        NodeRecord r = record(i);
+                        if (r.parent >= i) return false;
+                        Totals& t = summed[i];
+                        Totals& up = summed[r.parent];
+                        if (r.kind == KIND_FILE) {
+                            for (uint64_t k = r.contentStart; k - r.contentStart < r.contentCount && block(k, index, b); k++) t.bytes += b.length;
+                            up.files++;
+                        } else {
+                            up.files += t.files;
+                            up.dirs += t.dirs + 1;
+                        }
+                        up.bytes += t.bytes;
+                    }
+                    return true;
+                }
+
+                bool expand(NodeArena& tree, NodeId dir, uint32_t index, ostream& err) const override;
+
+                bool damaged(ostream& err) const {
+                    err << "Snapshot " << filename << " is damaged, some entries could not be loaded.\n";
+                    return false;
+                }
+        };
+
+        // Content of a file in a StoredTree, read straight from the mapping
+        class StoredFile : public StoredContent {
+            private:
+                shared_ptr<const StoredTree> source;
+                uint64_t length = 0;
+
+                template <typename Visit>
+                void forEachBlock(Visit visit) const {
+                    uint32_t index;
+                    BlockRecord b;
+                    for (uint64_t k = first; k < first + count; k++) {
+                        if (source->block(k, index, b)) visit(string_view(source->blobs() + b.offset, b.length));
+                    }
+                }
+
+            public:
+                uint64_t first, count; // Range of block references
+
+                StoredFile(shared_ptr<const StoredTree> source, uint64_t first, uint64_t count)
+                    : source(move(source)), first(first), count(count) {}
+
+                // Check every reference and sum up the length; false if any is out of range
+                bool check() {
+                    uint32_t index;
+                    BlockRecord b;
+                    if (first > source->h.refCount || count > source->h.refCount - first) return false;
+                    for (uint64_t k = first; k < first + count; k++) {
+                        if (!source->block(k, index, b)) return false;
+                        length += b.length;
+                    }
+                    return true;
+                }
+
+                const StoredTree* tree() const { return source.get(); }
+                size_t size() const override { return length; }
+
+                string bytes() const override {
+                    string out;
+                    out.reserve(length);
+                    forEachBlock([&](string_view b) { out.append(b); });
+                    return out;
+                }
+
+                Rope load() const override {
+                    Rope out;
+                    BlockStore& store = BlockStore::instance();
+                    forEachBlock([&](string_view b) { out.appendShared(store.intern(b)); });
+                    return out;
+                }
+
+                void forEachPiece(uint64_t from, uint64_t count, const function<void(string_view)>& visit) const override {
+                    uint64_t at = 0, end = from + count;
+                    forEachBlock([&](string_view b) {
+                        if (at < end && at + b.size() > from) {
+                            uint64_t skip = from > at ? from - at : 0;
+                            visit(b.substr(skip, min<uint64_t>(b.size(), end - at) - skip));
+                        }
+                        at += b.size();
+                    });
+                }
+        };
+
+        // Where to find the bytes of a block when the blob region is written: a range of the file it
+        // first appeared in, so nothing is copied while the tables are built
+        struct BlockSource {
+            static constexpr uint32_t STORED = UINT32_MAX; // offset is in the blob region of the stored tree
+            uint32_t content; // Index into Writer::contents, or STORED
+            uint64_t offset;
+        };
+
+        // Bytes of a file that contributed blocks: a view of its rope (compressed files decoded until the
+        // save is done), or for a file that is still on disk, its stored content, read again piece by
+        // piece when the blocks are written rather than held in memory in between
+        struct ContentSource {
+            Rope::View view;
+            shared_ptr<const StoredContent> stored;
+
+            template <typename Visit>
+            void forEachPiece(Visit visit) const {
+                if (stored) stored->forEachPiece(0, stored->size(), visit);
+                else view.forEachPiece(visit);
+            }
+
+            template <typename Visit>
+            void forEachPiece(uint64_t offset, uint64_t length, Visit visit) const {
+                if (stored) stored->forEachPiece(offset, length, visit);
+                else view.slice(offset, length).forEachPiece(visit);
+            }
+        };
+
+        // Collects the string, node, block and reference tables while walking the tree
+        struct Writer {
+            const NodeArena& tree;
+            const StoredTree* source; // Where stub directories and unloaded files are copied from, if anywhere
+            vector<char> strings;
+            unordered_map<NameId, uint32_t> stringIds; // Pool id -> string table offset, names only in use get written
+            unordered_map<uint32_t, uint32_t> storedStrings; // Same for names copied from the source, by their old offset
+            uint64_t stringCount = 0;
+            vector<NodeRecord> nodes;
+            unordered_map<BlockKey, uint32_t, BlockKeyHash> blockIds; // Content key -> block index
+            unordered_map<uint32_t, uint32_t> storedBlocks; // Block index in the source -> block index
+            vector<BlockRecord> blocks;
+            vector<BlockSource> sources; // Block index -> where its bytes are
+            vector<ContentSource> contents; // Files that contributed blocks
+            vector<uint32_t> refs;
+            vector<Totals> totals; // One per node record
+
+            // A file whose references are still to be filled in: chunked in parallel, then merged in node order
+            struct ContentJob {
+                uint32_t node; // Its record
+                const File* file; // nullptr for a run of source references
+                uint64_t first, count; // That run
+            };
+            vector<ContentJob> jobs;
+            uint64_t blobSize = 0;
+            bool ok = true; // Cleared if the source turns out to be damaged
+
+            Writer(const NodeArena& tree, const StoredTree* source) : tree(tree), source(source) {}
+
+            uint32_t addString(string_view s) {
+                uint32_t offset = strings.size(), len = s.size();
+                strings.insert(strings.end(), (const char*)&len, (const char*)&len + sizeof(len));
+                strings.insert(strings.end(), s.begin(), s.end());
+                stringCount++;
+                return offset;
+            }
+
+            uint32_t intern(NodeId node) {
+                auto it = stringIds.find(tree.nameId(node));
+                if (it != stringIds.end()) return it->second;
+                uint32_t offset = addString(tree.name(node));
+                stringIds.emplace(tree.nameId(node), offset);
+                return offset;
+            }
+
+            uint32_t internStored(uint32_t at) {
+                auto it = storedStrings.find(at);
+                if (it != storedStrings.end()) return it->second;
+                string_view name;
+                if (!source->name(at, name)) ok = false;
+                uint32_t offset = addString(name);
+                storedStrings.emplace(at, offset);
+                return offset;
+            }
+
+            // Append the block references of a range of source references, copying each block once
+            void addStoredRefs(uint64_t first, uint64_t count) {
+                uint32_t index;
+                BlockRecord b;
+                for (uint64_t k = first; k < first + count; k++) {
+                    if (!source->block(k, index, b)) {
+                        ok = false;
+                        return;
+                    }
+                    auto inserted = storedBlocks.emplace(index, blocks.size());
+                    if (inserted.second) {
+                        blocks.push_back({blobSize, b.length});
+                        sources.push_back({BlockSource::STORED, b.offset});
+                        blobSize += b.length;
+                    }
+                    refs.push_back(inserted.first->second);
+                }
+            }
+
+            void addFile(uint32_t node, const File& file) {
+                auto stored = dynamic_cast<const StoredFile*>(file.stored.get());
+                if (stored && stored->tree() == source) {
+                    jobs.push_back({node, nullptr, stored->first, stored->count}); // Never loaded: its blocks are copied as they are
+                } else {
+                    jobs.push_back({node, &file, 0, 0});
+                }
+            }
+
+            // Fill in the block references of every file. Chunking and hashing, the bulk of the work, run
+            // on the pool, one file per item; block numbers are then handed out in node order, so the
+            // result is the same for any number of workers.
+            void addContents(WorkStealingPool& pool) {
+                struct Chunk {
+                    BlockKey key;
+                    uint64_t length;
+                };
+                vector<vector<Chunk>> chunks(jobs.size());
+                vector<ContentSource> views(jobs.size());
+                pool.forEachIndex(jobs.size(), [&](size_t, size_t i) {
+                    if (!jobs[i].file) return;
+                    if (jobs[i].file->stored) views[i].stored = jobs[i].file->stored;
+                    else views[i].view = jobs[i].file->view(cerr); // Saves run in the background, with no command to report to
+                    Chunker::split(views[i], [&](string_view chunk) { chunks[i].push_back({blockKey(chunk), chunk.size()}); });
+                });
+                for (size_t i = 0; i < jobs.size() && ok; i++) {
+                    uint64_t first = refs.size();
+                    if (!jobs[i].file) {
+                        addStoredRefs(jobs[i].first, jobs[i].count);
+                    } else {
+                        uint64_t offset = 0;
+                        bool kept = false;
+                        for (const Chunk& chunk : chunks[i]) {
+                            auto inserted = blockIds.emplace(chunk.key, blocks.size());
+                            if (inserted.second) {
+                                if (!kept) contents.push_back(views[i]);
+                                kept = true;
+                                blocks.push_back({blobSize, chunk.length});
+                                sources.push_back({uint32_t(contents.size() - 1), offset});
+                                blobSize += chunk.length;
+                            }
+                            refs.push_back(inserted.first->second);
+                            offset += chunk.length;
+                        }
+                        vector<Chunk>().swap(chunks[i]);
+                        views[i] = ContentSource(); // Only the files that contributed blocks stay decoded
+                    }
+                    nodes[jobs[i].node].contentStart = first;
+                    nodes[jobs[i].node].contentCount = refs.size() - first;
+                }
+            }
+
+            // Copy the records below a stub directory from the source, renumbered, without loading them
+            void addStored(NodeId dir, uint32_t self) {
+                uint64_t first = tree.storedRecord(dir);
+                NodeRecord top = source->record(first);
+                nodes[self].contentCount = top.contentCount;
+                for (uint64_t i = first + 1; ok && i < top.contentStart; i++) {
+                    NodeRecord r = source->record(i);
+                    if (r.parent < first || r.parent >= i) {
+                        ok = false;
+                        break;
+                    }
+                    r.parent = r.parent - first + self;
+                    r.name = internStored(r.name);
+                    if (r.kind == KIND_DIR) {
+                        if (r.contentStart <= i || r.contentStart > top.contentStart) ok = false;
+                        r.contentStart = r.contentStart - first + self;
+                    } else {
+                        jobs.push_back({uint32_t(nodes.size()), nullptr, r.contentStart, r.contentCount});
+                    }
+                    nodes.push_back(r);
+                    totals.push_back(source->totals(i));
+                }
+            }
+
+            void addDir(NodeId dir, uint32_t parent) {
+                uint32_t self = nodes.size();
+                nodes.push_back({KIND_DIR, intern(dir), parent, 0, 0, tree.childCount(dir)});
+                totals.push_back(tree.totals(dir));
+                if (tree.isStub(dir)) {
+                    addStored(dir, self);
+                } else {
+                    for (NodeId f : tree.files(dir)) {
+                        addFile(nodes.size(), tree.file(f));
+                        nodes.push_back({KIND_FILE, intern(f), self, 0, 0, 0});
+                        totals.push_back(tree.totals(f));
+                    }
+                    for (NodeId d : tree.subdirectories(dir)) {
+                        addDir(d, self); // Recursively add subdirectories
+                    }
+                }
+                nodes[self].contentStart = nodes.size(); // End of the subtree
+            }
+        };
+
+        static bool writeAt(int fd, const char* data, size_t len, uint64_t offset) {
+            while (len > 0) {
+                ssize_t n = pwrite(fd, data, len, offset);
+                if (n <= 0) return false;
+                data += n;
+                len -= n;
+                offset += n;
+            }
+            return true;
+        }
+
+        // Make a rename in the directory holding path durable
+        static bool syncDirectory(const string& path) {
+            size_t slash = path.rfind('/');
+            string dir = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+            int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+            if (fd < 0) return false;
+            bool synced = fsync(fd) == 0;
+            ::close(fd);
+            return synced;
+        }
+
+    public:
+        static constexpr size_t WRITE_BATCH = 1 << 20; // Blob bytes a worker gathers per write
+
+        // Write the tree under root to filename (through a temporary file, so a crash never leaves half a
+        // snapshot). True only once the file and its directory entry are on disk, so the journals it
+        // replaces can go. Contents are chunked on `threads` workers, and the blob region, whose layout is known
+        // once the tables are built, is written by all of them at once, each batch of blocks at its offset.
+        static bool save(const NodeArena& tree, const string& filename, uint32_t journalGen = 0, size_t threads = 1) {
+            WorkStealingPool pool(threads);
+            Writer w(tree, static_cast<const StoredTree*>(tree.lazySource()));
+            w.addDir(NodeArena::ROOT, 0);
+            if (w.ok) w.addContents(pool);
+            if (!w.ok) return false;
+
+            Header h{};
+            memcpy(h.magic, MAGIC, sizeof(MAGIC));
+            h.version = VERSION;
+            h.journalGen = journalGen;
+            h.stringCount = w.stringCount;
+            h.stringOffset = sizeof(Header);
+            h.nodeCount = w.nodes.size();
+            h.nodeOffset = h.stringOffset + w.strings.size();
+            h.blockCount = w.blocks.size();
+            h.blockOffset = h.nodeOffset + w.nodes.size() * sizeof(NodeRecord);
+            h.refCount = w.refs.size();
+            h.refOffset = h.blockOffset + w.blocks.size() * sizeof(BlockRecord);
+            h.totalOffset = h.refOffset + w.refs.size() * sizeof(uint32_t);
+            h.blobOffset = h.totalOffset + w.totals.size() * sizeof(Totals);
+            h.blobSize = w.blobSize;
+
+            string tmp = filename + ".tmp";
+            int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) return false;
+            bool written = writeAt(fd, (const char*)&h, sizeof(h), 0) &&
+                           writeAt(fd, w.strings.data(), w.strings.size(), h.stringOffset) &&
+                           writeAt(fd, (const char*)w.nodes.data(), w.nodes.size() * sizeof(NodeRecord), h.nodeOffset) &&
+                           writeAt(fd, (const char*)w.blocks.data(), w.blocks.size() * sizeof(BlockRecord), h.blockOffset) &&
+                           writeAt(fd, (const char*)w.refs.data(), w.refs.size() * sizeof(uint32_t), h.refOffset) &&
+                           writeAt(fd, (const char*)w.totals.data(), w.totals.size() * sizeof(Totals), h.totalOffset);
+
+            // Blob region in batches of consecutive blocks
+            vector<size_t> batches; // First block of each batch
+            for (size_t i = 0, bytes = WRITE_BATCH; i < w.blocks.size(); i++) {
+                if (bytes >= WRITE_BATCH) {
+                    batches.push_back(i);
+                    bytes = 0;
+                }
+                bytes += w.blocks[i].length;
+            }
+            atomic<bool> ok{written};
+            pool.forEachIndex(written ? batches.size() : 0, [&](size_t, size_t b) {
+                size_t from = batches[b], to = b + 1 < batches.size() ? batches[b + 1] : w.blocks.size();
+                string buffer;
+                buffer.reserve(w.blocks[to - 1].offset + w.blocks[to - 1].length - w.blocks[from].offset);
+                for (size_t i = from; i < to; i++) {
+                    const BlockSource& src = w.sources[i];
+                    if (src.content == BlockSource::STORED) {
+                        buffer.append(w.source->blobs() + src.offset, w.blocks[i].length); // Straight from the old mapping
+                    } else {
+                        w.contents[src.content].forEachPiece(src.offset, w.blocks[i].length, [&](string_view piece) { buffer.append(piece); });
+                    }
+                }
+                if (!writeAt(fd, buffer.data(), buffer.size(), h.blobOffset + w.blocks[from].offset)) ok = false;
+            });
+            if (ok && fdatasync(fd) != 0) ok = false;
+            if (::close(fd) != 0 || !ok) return false;
+            return rename(tmp.c_str(), filename.c_str()) == 0 && syncDirectory(filename);
+        }
+
+        // Replace tree with the one stored in filename and report the journal generation it was saved at.
+        // Returns false (leaving tree untouched) if the file is missing, and prints an error to err if it
+        // exists but is not a valid snapshot. Contents come back as blocks of the block store, one buffer per
+        // distinct block. Blocks are copied out and hashed, and file ropes built, on `threads` workers;
+        // only the node table, which links into the one arena, is read on the calling thread.
+        static bool load(NodeArena& tree, const string& filename, uint32_t& journalGen, ostream& err, size_t threads = 1) {
+            MappedFile map(filename);
+            if (!map.ok()) return false;
+            Header h;
+            if (!readHeader(map, filename, h, err)) return false;
+            const char* base = map.data();
+
+            // String table: interned straight from the mapping, keyed the way node records refer to names
+            NodeArena fresh;
+            unordered_map<uint64_t, NameId> strings;
+            strings.reserve(h.stringCount);
+            size_t pos = h.stringOffset;
+            for (uint64_t i = 0; i < h.stringCount; i++) {
+                uint32_t len;
+                if (pos + sizeof(len) > h.nodeOffset) return corrupt(filename, err);
+                memcpy(&len, base + pos, sizeof(len));
+                if (len > h.nodeOffset - pos - sizeof(len)) return corrupt(filename, err);
+                strings.emplace(h.version >= 3 ? pos - h.stringOffset : i, fresh.intern(string_view(base + pos + sizeof(len), len)));
+                pos += sizeof(len) + len;
+            }
+
+            // Block table: every distinct block copied once out of the mapping into the block store
+            BlockStore& store = BlockStore::instance();
+            const char* blobs = base + h.blobOffset;
+            WorkStealingPool pool(threads);
+            vector<shared_ptr<const string>> blocks(h.blockCount);
+            atomic<bool> bad{false};
+            pool.forEachIndex(h.blockCount, [&](size_t, size_t i) {
+                BlockRecord b;
+                memcpy(&b, base + h.blockOffset + i * sizeof(BlockRecord), sizeof(b));
+                if (b.offset > h.blobSize || b.length > h.blobSize - b.offset || b.length == 0) bad = true;
+                else blocks[i] = store.intern(string_view(blobs + b.offset, b.length));
+            });
+            if (bad) return corrupt(filename, err);
+
+            // Node table: build into a fresh tree, swapped in only once everything checked out. Contents are
+            // filled in afterwards, when no more file slots get added.
+            struct FileContent {
+                NodeId node;
+                uint64_t start, count; // The record's content range
+            };
+            vector<FileContent> files;
+            vector<NodeId> dirs(h.nodeCount, NO_NODE); // Snapshot node index -> arena directory, for parent lookups
+            dirs[0] = NodeArena::ROOT;
+            for (uint64_t i = 1; i < h.nodeCount; i++) {
+                NodeRecord r;
+                memcpy(&r, base + h.nodeOffset + i * sizeof(NodeRecord), sizeof(r));
+                auto name = strings.find(r.name);
+                if (name == strings.end() || r.parent >= i || dirs[r.parent] == NO_NODE) return corrupt(filename, err);
+                NodeId parent = dirs[r.parent];
+                if (fresh.child(parent, name->second) != NO_NODE) return corrupt(filename, err); // Duplicate name
+                if (r.kind == KIND_DIR) {
+                    dirs[i] = fresh.addDir(parent, name->second);
+                } else if (r.kind == KIND_FILE) {
+                    uint64_t limit = h.version >= 2 ? h.refCount : h.blobSize;
+                    if (r.contentStart > limit || r.contentCount > limit - r.contentStart) return corrupt(filename, err);
+                    files.push_back({fresh.addFile(parent, name->second), r.contentStart, r.contentCount});
+                } else {
+                    return corrupt(filename, err);
+                }
+            }
+            pool.forEachIndex(files.size(), [&](size_t, size_t i) {
+                Rope& content = fresh.file(files[i].node).content;
+                if (h.version == 1) {
+                    content = store.build(string_view(blobs + files[i].start, files[i].count)); // Chunked on the way in
+                    return;
+                }
+                for (uint64_t k = files[i].start; k < files[i].start + files[i].count; k++) {
+                    uint32_t ref;
+                    memcpy(&ref, base + h.refOffset + k * sizeof(uint32_t), sizeof(ref));
+                    if (ref >= blocks.size()) bad = true;
+                    else content.appendShared(blocks[ref]);
+                }
+            });
+            if (bad) return corrupt(filename, err);
+            for (const FileContent& f : files) fresh.resized(f.node);
+
+            tree = move(fresh);
+            journalGen = h.journalGen;
+            return true;
+        }
+
+        // Like load(), but only the entries of the root are read now. Every other directory comes in as a
+        // stub that loads its own entries on NodeArena::expand(), and file contents stay in the mapping
+        // until a file is first used. Older versions have no subtree extents and are loaded eagerly.
+        static bool openLazy(NodeArena& tree, const string& filename, uint32_t& journalGen, ostream& err) {
+            auto source = make_shared<StoredTree>(filename);
+            if (!source->map.ok()) return false;
+            if (!readHeader(source->map, filename, source->h, err)) return false;
+            if (source->h.version < 3) return load(tree, filename, journalGen, err);
+            if (source->h.version < 4 && !source->sumTotals()) return corrupt(filename, err);
+
+            NodeArena fresh;
+            fresh.setLazySource(source);
+            if (!source->expand(fresh, NodeArena::ROOT, 0, err)) return corrupt(filename, err);
+            tree = move(fresh);
+            journalGen = source->h.journalGen;
+            return true;
+        }
+
+    private:
+        static bool corrupt(const string& filename, ostream& err) {
+            err << "Snapshot " << filename << " is corrupt, ignoring it.\n";
+            return false;
+        }
+};
+
+
+// Entries of one stored directory: files keep their contents in the mapping, subdirectories are stubs
+inline bool Snapshot::StoredTree::expand(NodeArena& tree, NodeId dir, uint32_t index, ostream& err) const {
+    NodeRecord top = record(index);
+    if (top.kind != KIND_DIR || top.contentStart <= index || top.contentStart > h.nodeCount) return damaged(err);
+    for (uint64_t i = index + 1; i < top.contentStart;) {
+        NodeRecord r = record(i);
+        string_view name;
+        if (r.parent != index || !this->name(r.name, name)) return damaged(err);
+        NameId id = tree.intern(name);
+        if (tree.child(dir, id) != NO_NODE) return damaged(err); // Duplicate name
+        if (r.kind == KIND_DIR) {
+            if (r.contentStart <= i || r.contentStart > top.contentStart) return damaged(err);
+            tree.addStubDir(dir, id, i, totals(i));
+            i = r.contentStart; // Skip its subtree
+        } else if (r.kind == KIND_FILE) {
+            auto content = make_shared<StoredFile>(shared_from_this(), r.contentStart, r.contentCount);
+            if (!content->check()) return damaged(err);
+            NodeId f = tree.addFile(dir, id);
+            tree.file(f).stored = move(content);
+            tree.resized(f);
+            i++;
+        } else {
+            return damaged(err);
+        }
+    }
+    return true;
+}
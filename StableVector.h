@@ -0,0 +1,95 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+using namespace std;
+
+
+// Growable array whose elements never move. Slots come in segments, the first of FIRST slots and each
+// one after that twice the size of the one before, so growing adds a segment where a vector would
+// reallocate and copy. A reference to an element stays valid however much the array grows, which lets
+// one thread use an element while another appends (see NodeArena::setConcurrent). An index finds its
+// segment with one bit scan.
+template <typename T>
+class StableVector {
+    private:
+        static constexpr size_t FIRST_BITS = 6;
+        static constexpr size_t FIRST = size_t(1) << FIRST_BITS; // Slots of the first segment
+        static constexpr size_t SEGMENTS = 27; // Enough for every 32-bit index
+        unique_ptr<T[]> segments[SEGMENTS]; // Allocated (and their slots default-constructed) as they are needed
+        size_t count = 0; // Elements in use
+        size_t allocated = 0; // Slots in the segments allocated so far
+
+        // Segment s holds indices FIRST * (2^s - 1) up to FIRST * (2^(s+1) - 1): offset by FIRST, an index
+        // has its segment in its top bit
+        static size_t segmentOf(size_t i) { return 63 - __builtin_clzll(i + FIRST) - FIRST_BITS; }
+        static size_t startOf(size_t segment) { return (FIRST << segment) - FIRST; }
+
+        template <typename Owner, typename Element>
+        struct Iterator {
+            Owner* owner;
+            size_t i;
+            Element& operator*() const { return (*owner)[i]; }
+            Iterator& operator++() {
+                i++;
+                return *this;
+            }
+            bool operator!=(const Iterator& other) const { return i != other.i; }
+        };
+
+    public:
+        using iterator = Iterator<StableVector, T>;
+        using const_iterator = Iterator<const StableVector, const T>;
+
+        StableVector() = default;
+        StableVector(const StableVector& other) {
+            for (const T& x : other) emplace_back() = x;
+        }
+        StableVector(StableVector&& other) noexcept { *this = move(other); }
+        StableVector& operator=(const StableVector& other) {
+            if (this != &other) *this = StableVector(other);
+            return *this;
+        }
+        StableVector& operator=(StableVector&& other) noexcept {
+            for (size_t s = 0; s < SEGMENTS; s++) segments[s] = move(other.segments[s]);
+            count = exchange(other.count, 0);
+            allocated = exchange(other.allocated, 0);
+            return *this;
+        }
+
+        T& operator[](size_t i) {
+            size_t s = segmentOf(i);
+            return segments[s][i - startOf(s)];
+        }
+        const T& operator[](size_t i) const {
+            size_t s = segmentOf(i);
+            return segments[s][i - startOf(s)];
+        }
+
+        // Append a default-constructed slot and return it
+        T& emplace_back() {
+            if (count == allocated) {
+                size_t s = segmentOf(count);
+                segments[s] = make_unique<T[]>(FIRST << s);
+                allocated = startOf(s + 1);
+            }
+            return (*this)[count++];
+        }
+
+        T& back() { return (*this)[count - 1]; }
+
+        void clear() {
+            for (unique_ptr<T[]>& s : segments) s.reset();
+            count = allocated = 0;
+        }
+
+        size_t size() const { return count; }
+        bool empty() const { return count == 0; }
+        size_t capacity() const { return allocated; }
+
+        iterator begin() { return {this, 0}; }
+        iterator end() { return {this, count}; }
+        const_iterator begin() const { return {this, 0}; }
+        const_iterator end() const { return {this, count}; }
+};
@@ -0,0 +1,147 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+using namespace std;
+
+
+// Latency histogram with HDR-style log-linear buckets: every power of two is split into SUB_BUCKETS
+// equal slices, so any recorded value is reported within 1/SUB_BUCKETS (about 3%) of itself while
+// covering 1 ns to centuries in a fixed 15 KB array. Recording is a clz, a shift and an increment of
+// the bucket (plus the running sum), all relaxed atomics, so any number of threads record at once
+// without a lock. A report taken meanwhile may be a few samples out of step, never torn.
+class LatencyHistogram {
+    public:
+        static constexpr int SUB_BITS = 5;
+        static constexpr uint64_t SUB_BUCKETS = uint64_t(1) << SUB_BITS;
+
+    private:
+        static constexpr int BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+        atomic<uint64_t> counts[BUCKETS] = {};
+        atomic<uint64_t> sum{0}, maximum{0};
+
+        static int bucketOf(uint64_t ns) {
+            if (ns < SUB_BUCKETS) return ns; // Exact below the first power of two that needs splitting
+            int shift = 63 - __builtin_clzll(ns) - SUB_BITS; // Keeps the top SUB_BITS + 1 bits
+            return shift * SUB_BUCKETS + (ns >> shift);
+        }
+        static uint64_t upperBound(int bucket) { // Largest value that lands in the bucket
+            int shift = bucket / SUB_BUCKETS - 1;
+            if (shift < 0) return bucket;
+            uint64_t base = (bucket % SUB_BUCKETS + SUB_BUCKETS);
+            return ((base + 1) << shift) - 1;
+        }
+
+    public:
+        void record(uint64_t ns) {
+            counts[bucketOf(ns)].fetch_add(1, memory_order_relaxed);
+            sum.fetch_add(ns, memory_order_relaxed);
+            uint64_t seen = maximum.load(memory_order_relaxed);
+            while (ns > seen && !maximum.compare_exchange_weak(seen, ns, memory_order_relaxed)) {} // Only while it is a new maximum
+        }
+
+        // Summed over the buckets: reports are rare, recording is not
+        uint64_t count() const {
+            uint64_t total = 0;
+            for (const auto& c : counts) total += c.load(memory_order_relaxed);
+            return total;
+        }
+        uint64_t max() const { return maximum.load(memory_order_relaxed); }
+        double mean() const {
+            uint64_t total = count();
+            return total ? double(sum.load(memory_order_relaxed)) / total : 0;
+        }
+
+        // Smallest bucket bound that covers fraction q of the recorded values
+        uint64_t percentile(double q) const {
+            uint64_t total = count();
+            if (total == 0) return 0;
+            uint64_t rank = uint64_t(q * total + 0.5);
+            if (rank == 0) rank = 1;
+            uint64_t seen = 0;
+            for (int b = 0; b < BUCKETS; b++) {
+                seen += counts[b].load(memory_order_relaxed);
+                if (seen >= rank) return min(upperBound(b), max());
+            }
+            return max();
+        }
+};
+
+
+// Process-wide operation statistics: one latency histogram per named operation. Operations are
+// registered once (callers keep the histogram in a static) so recording never looks anything up and
+// never takes the lock, which only covers the list of operations.
+class Stats {
+    private:
+        struct Op {
+            string name;
+            LatencyHistogram latency;
+        };
+
+        mutable mutex lock;
+        deque<Op> ops; // In registration order, never moves
+        unordered_map<string, LatencyHistogram*> byName;
+
+    public:
+        static Stats& instance() {
+            static Stats stats;
+            return stats;
+        }
+
+        // Histogram of the operation, registered on first use
+        LatencyHistogram& histogram(const string& name) {
+            lock_guard<mutex> guard(lock);
+            auto it = byName.find(name);
+            if (it != byName.end()) return *it->second;
+            ops.emplace_back();
+            ops.back().name = name;
+            return *(byName[name] = &ops.back().latency);
+        }
+
+        // Count, mean, p50, p99 and max (in microseconds) of every operation that ran
+        void print(ostream& out) const {
+            lock_guard<mutex> guard(lock);
+            out << left << setw(16) << "operation" << right << setw(10) << "count" << setw(12) << "mean us"
+                << setw(12) << "p50 us" << setw(12) << "p99 us" << setw(12) << "max us" << '\n';
+            out << fixed << setprecision(1);
+            for (const Op& op : ops) {
+                const LatencyHistogram& h = op.latency;
+                if (h.count() == 0) continue;
+                out << left << setw(16) << op.name << right << setw(10) << h.count() << setw(12) << h.mean() / 1000
+                    << setw(12) << h.percentile(0.5) / 1000.0 << setw(12) << h.percentile(0.99) / 1000.0
+                    << setw(12) << h.max() / 1000.0 << '\n';
+            }
+            out << defaultfloat << setprecision(6);
+        }
+};
+
+// Times the enclosing scope into the operation's histogram
+class ScopedLatency {
+    private:
+        LatencyHistogram& histogram;
+        chrono::steady_clock::time_point started;
+    public:
+        explicit ScopedLatency(LatencyHistogram& histogram) : histogram(histogram), started(chrono::steady_clock::now()) {}
+        ~ScopedLatency() {
+            histogram.record(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started).count());
+        }
+};
+
+// FS_TIME_SCOPE("name") times the rest of the enclosing block as operation "name" (a constant: the
+// histogram is looked up once per call site). Building with -DFS_NO_STATS removes the timer entirely.
+#define FS_STATS_CONCAT2(a, b) a##b
+#define FS_STATS_CONCAT(a, b) FS_STATS_CONCAT2(a, b)
+#ifndef FS_NO_STATS
+#define FS_TIME_SCOPE(name)                                                    \
+    static LatencyHistogram& FS_STATS_CONCAT(fsStatsOp, __LINE__) = Stats::instance().histogram(name); \
+    ScopedLatency FS_STATS_CONCAT(fsStatsTimer, __LINE__)(FS_STATS_CONCAT(fsStatsOp, __LINE__))
+#else
+#define FS_TIME_SCOPE(name) ((void)0)
+#endif
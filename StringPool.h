@@ -0,0 +1,67 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include "StableVector.h"
+
+using namespace std;
+
+using NameId = uint32_t; // Handle of an interned name
+
+
+// Interns names so every distinct name is stored once, however many nodes use it.
+// Strings never move once interned, so the views used as index keys stay valid as the pool grows, and
+// a name can be read while another thread interns one.
+// Names are never freed one by one: a name stays after the last node using it is deleted or renamed.
+// NodeArena::compactNames() rebuilds the pool from the live names, which checkpoints do once it has
+// grown to twice the live nodes; without a snapshot nothing compacts it.
+class StringPool {
+    private:
+        StableVector<string> strings; // NameId -> name
+        unordered_map<string_view, NameId> ids; // name -> NameId, keys point into `strings`
+        size_t bytes = 0; // Characters held by the pool
+
+        void reindex() {
+            ids.clear();
+            for (NameId id = 0; id < strings.size(); id++) ids.emplace(strings[id], id);
+        }
+
+    public:
+        StringPool() = default;
+        StringPool(const StringPool& other) : strings(other.strings), bytes(other.bytes) { reindex(); } // Keys must point at our own copies
+        StringPool& operator=(const StringPool& other) {
+            strings = other.strings;
+            bytes = other.bytes;
+            reindex();
+            return *this;
+        }
+        StringPool(StringPool&&) = default; // Moving keeps the strings in place, so the keys stay valid
+        StringPool& operator=(StringPool&&) = default;
+
+        NameId intern(string_view name) {
+            auto it = ids.find(name);
+            if (it != ids.end()) return it->second;
+            NameId id = strings.size();
+            strings.emplace_back() = name;
+            ids.emplace(strings.back(), id);
+            bytes += name.size();
+            return id;
+        }
+
+        // Look a name up without adding it; returns false if it was never interned
+        bool find(string_view name, NameId& id) const {
+            auto it = ids.find(name);
+            if (it == ids.end()) return false;
+            id = it->second;
+            return true;
+        }
+
+        const string& str(NameId id) const { return strings[id]; }
+        size_t size() const { return strings.size(); }
+
+        // Approximate heap footprint: characters, string headers and index entries
+        size_t memoryUsage() const {
+            return bytes + strings.size() * (sizeof(string) + sizeof(string_view) + sizeof(NameId) + 2 * sizeof(void*));
+        }
+};
@@ -0,0 +1,140 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+
+// Fixed set of workers that drain a shared work list of 32-bit items (node ids, for tree walks).
+// Each worker has its own deque: it pushes and pops at the back, so a walk stays depth-first and
+// cache-warm, and when it runs dry it steals from the front of another worker's deque, which
+// holds the oldest and usually largest pieces of work. The caller of run() is worker 0, so a pool
+// of one runs everything inline without any background thread.
+class WorkStealingPool {
+    public:
+        using Job = function<void(size_t worker, uint32_t item)>;
+
+    private:
+        struct Queue {
+            mutex lock;
+            deque<uint32_t> items;
+        };
+
+        vector<unique_ptr<Queue>> queues; // One per worker
+        vector<thread> threads; // Workers 1..n-1
+        const Job* job = nullptr; // Job of the current run()
+        atomic<size_t> pending{0}; // Items pushed but not yet finished
+        mutex lock;
+        condition_variable wake, idle;
+        uint64_t epoch = 0; // Bumped by every run() to start the background workers
+        size_t busy = 0; // Background workers still inside the current run
+        bool stopping = false;
+
+        bool take(size_t worker, uint32_t& item) {
+            {
+                Queue& own = *queues[worker];
+                lock_guard<mutex> guard(own.lock);
+                if (!own.items.empty()) {
+                    item = own.items.back();
+                    own.items.pop_back();
+                    return true;
+                }
+            }
+            for (size_t i = 1; i < queues.size(); i++) {
+                Queue& victim = *queues[(worker + i) % queues.size()];
+                lock_guard<mutex> guard(victim.lock);
+                if (!victim.items.empty()) {
+                    item = victim.items.front();
+                    victim.items.pop_front();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Work until every pushed item, including the ones pushed along the way, has finished
+        void drain(size_t worker) {
+            uint32_t item;
+            while (pending.load() > 0) {
+                if (take(worker, item)) {
+                    (*job)(worker, item);
+                    pending--;
+                } else {
+                    this_thread::yield(); // Others still hold work that may fan out
+                }
+            }
+        }
+
+        void workerLoop(size_t worker) {
+            uint64_t seen = 0;
+            unique_lock<mutex> guard(lock);
+            while (true) {
+                wake.wait(guard, [&] { return stopping || epoch != seen; });
+                if (stopping) return;
+                seen = epoch;
+                guard.unlock();
+                drain(worker);
+                guard.lock();
+                if (--busy == 0) idle.notify_all();
+            }
+        }
+
+    public:
+        explicit WorkStealingPool(size_t workers) {
+            if (workers == 0) workers = 1;
+            for (size_t i = 0; i < workers; i++) queues.push_back(make_unique<Queue>());
+            for (size_t i = 1; i < workers; i++) threads.emplace_back(&WorkStealingPool::workerLoop, this, i);
+        }
+        WorkStealingPool(const WorkStealingPool&) = delete;
+        WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+        ~WorkStealingPool() {
+            {
+                lock_guard<mutex> guard(lock);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (thread& t : threads) t.join();
+        }
+
+        size_t size() const { return queues.size(); }
+
+        // Add an item; called by run() for the seeds and by the job for the work it fans out into
+        void push(size_t worker, uint32_t item) {
+            pending++;
+            Queue& own = *queues[worker];
+            lock_guard<mutex> guard(own.lock);
+            own.items.push_back(item);
+        }
+
+        // Run job over the seeds and everything they push, on all workers. Blocks until done.
+        void run(const vector<uint32_t>& seeds, const Job& work) {
+            job = &work;
+            for (size_t i = 0; i < seeds.size(); i++) push(i % queues.size(), seeds[i]);
+            {
+                lock_guard<mutex> guard(lock);
+                busy = threads.size();
+                epoch++;
+            }
+            wake.notify_all();
+            drain(0);
+            unique_lock<mutex> guard(lock);
+            idle.wait(guard, [&] { return busy == 0; }); // Nobody may still be holding the job
+            job = nullptr;
+        }
+
+        // Call work(worker, i) for every i below count, spread over all workers. Blocks until done.
+        void forEachIndex(size_t count, const function<void(size_t, size_t)>& work) {
+            vector<uint32_t> items(count);
+            iota(items.begin(), items.end(), 0);
+            run(items, [&](size_t worker, uint32_t i) { work(worker, i); });
+        }
+};
@@ -0,0 +1,97 @@
+#pragma once
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+#include "../FileSystem.h"
+
+using namespace std;
+
+
+// Builds synthetic trees through the public FileSystem commands, so generation exercises the same
+// paths as a user would. Everything is derived from the seed: the same seed and sizes give the same
+// tree, byte for byte, on every machine.
+class TreeGenerator {
+    private:
+        mt19937_64 rng;
+        vector<string> words;
+
+        static string numbered(const string& prefix, size_t i) {
+            string digits = to_string(i);
+            return prefix + string(digits.size() < 6 ? 6 - digits.size() : 0, '0') + digits;
+        }
+
+    public:
+        explicit TreeGenerator(uint64_t seed) : rng(seed) {
+            static const char* vocabulary[] = {"alpha", "beta", "gamma", "delta", "epsilon", "zeta", "eta", "theta",
+                                               "iota", "kappa", "lambda", "mu", "nu", "xi", "omicron", "pi",
+                                               "rho", "sigma", "tau", "upsilon", "phi", "chi", "psi", "omega"};
+            words.assign(begin(vocabulary), end(vocabulary));
+        }
+
+        size_t uniform(size_t bound) { return bound == 0 ? 0 : rng() % bound; }
+
+        // Roughly `bytes` of space-separated words
+        string text(size_t bytes) {
+            string out;
+            out.reserve(bytes + 8);
+            while (out.size() < bytes) {
+                if (!out.empty()) out += ' ';
+                out += words[uniform(words.size())];
+            }
+            out.resize(bytes);
+            return out;
+        }
+
+        static string fileName(size_t i) { return numbered("f", i) + ".txt"; }
+        static string dirName(size_t i) { return numbered("d", i); }
+
+        // One directory holding `files` empty files: /<root>/f000000.txt ...
+        void wide(FileSystem& fs, const string& root, size_t files) {
+            fs.mkdir(root);
+            for (size_t i = 0; i < files; i++) fs.createFile(root + "/" + fileName(i));
+        }
+
+        // A chain of `depth` nested directories below root with `filesPerLevel` files in each.
+        // Returns the path of the deepest directory.
+        string deep(FileSystem& fs, const string& root, size_t depth, size_t filesPerLevel) {
+            string path = root;
+            fs.mkdir(path);
+            for (size_t level = 0; level < depth; level++) {
+                for (size_t i = 0; i < filesPerLevel; i++) fs.createFile(path + "/" + fileName(i));
+                path += "/" + dirName(level);
+                fs.mkdir(path);
+            }
+            return path;
+        }
+
+        // `files` files of about `bytes` each, written in `appends` chunks so their content is spread
+        // over many rope pieces, spread over directories of `perDir` files
+        void content(FileSystem& fs, const string& root, size_t files, size_t bytes, size_t appends, size_t perDir) {
+            fs.mkdir(root);
+            for (size_t i = 0; i < files; i++) {
+                string dir = root + "/" + dirName(i / perDir);
+                if (i % perDir == 0) fs.mkdir(dir);
+                string file = dir + "/" + fileName(i);
+                fs.createFile(file);
+                for (size_t k = 0; k < appends; k++) fs.writeFile(file, text(bytes / appends));
+                fs.closeFile(file);
+            }
+        }
+
+        // A random tree: each directory gets up to `fanout` subdirectories (fewer further down) and
+        // up to `files` small files, down to `depth` levels
+        void mixed(FileSystem& fs, const string& root, size_t depth, size_t fanout, size_t files) {
+            fs.mkdir(root);
+            size_t count = 1 + uniform(files);
+            for (size_t i = 0; i < count; i++) {
+                string file = root + "/" + fileName(i);
+                fs.createFile(file);
+                fs.writeFile(file, text(64 + uniform(512)));
+                fs.closeFile(file);
+            }
+            if (depth == 0) return;
+            size_t dirs = 1 + uniform(fanout);
+            for (size_t i = 0; i < dirs; i++) mixed(fs, root + "/" + dirName(i), depth - 1, max<size_t>(1, fanout - 1), files);
+        }
+};
@@ -0,0 +1,313 @@
+// Micro-benchmarks for every FileSystem command and for load/save round trips.
+//
+//   g++ -std=c++17 -O2 -pthread benchmarks/bench.cpp -o fs_bench
+//   ./fs_bench [--format json|csv] [--out file] [--scale S] [--repeats R] [--seed N] [--filter text] [--dir tmpdir]
+//
+// Trees come from TreeGenerator, so a given seed and scale measure the same work on every run.
+// Command output (cout and cerr) goes to a null stream; results go to stdout (or --out) and progress to stderr.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "TreeGenerator.h"
+
+using namespace std;
+
+
+struct Result {
+    string name; // Command or operation
+    string shape; // Tree it ran against
+    size_t n; // Size of that tree (entries, depth or files, see the shape)
+    size_t ops; // Operations timed per repeat
+    double bestNs, medianNs; // Per operation
+};
+
+// Swallows everything the commands print
+class NullBuffer : public streambuf {
+    protected:
+        int overflow(int c) override { return c; }
+        streamsize xsputn(const char*, streamsize n) override { return n; }
+};
+
+// Delete the files a run leaves in its scratch directory (bench.dat, bench.fss and its journals)
+void removeScratch(const string& dir) {
+    DIR* d = opendir(dir.c_str());
+    if (!d) return;
+    while (dirent* e = readdir(d)) {
+        string name = e->d_name;
+        if (name.rfind("bench.", 0) == 0) remove((dir + "/" + name).c_str());
+    }
+    closedir(d);
+}
+
+class BenchmarkSuite {
+    private:
+        uint64_t seed;
+        int repeats;
+        string filter;
+        ostream& progress;
+        vector<Result> results;
+
+    public:
+        using Setup = function<void(FileSystem&, TreeGenerator&)>;
+        using Op = function<void(FileSystem&, size_t)>;
+
+        BenchmarkSuite(uint64_t seed, int repeats, string filter, ostream& progress)
+            : seed(seed), repeats(repeats), filter(move(filter)), progress(progress) {}
+
+        // Time `ops` calls of op on a fresh FileSystem prepared by setup (untimed), `repeats` times
+        void run(const string& name, const string& shape, size_t n, size_t ops, const Setup& setup, const Op& op) {
+            string label = name + "/" + shape;
+            if (!filter.empty() && label.find(filter) == string::npos) return;
+            progress << label << " (n=" << n << ", ops=" << ops << ")..." << flush;
+            vector<double> samples;
+            for (int r = 0; r < repeats; r++) {
+                auto fs = make_unique<FileSystem>();
+                TreeGenerator gen(seed);
+                setup(*fs, gen);
+                auto started = chrono::steady_clock::now();
+                for (size_t i = 0; i < ops; i++) op(*fs, i);
+                double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - started).count();
+                samples.push_back(ns / max<size_t>(ops, 1));
+                fs->closeStorage(); // Only does something for the journaled runs
+            }
+            sort(samples.begin(), samples.end());
+            results.push_back({name, shape, n, ops, samples.front(), samples[samples.size() / 2]});
+            progress << " " << samples[samples.size() / 2] << " ns/op\n";
+        }
+
+        void writeJson(ostream& out, double scale) const {
+            out << "{\n  \"seed\": " << seed << ",\n  \"scale\": " << scale << ",\n  \"repeats\": " << repeats
+                << ",\n  \"kernel\": \"" << search::kernelName() << "\",\n  \"results\": [\n";
+            for (size_t i = 0; i < results.size(); i++) {
+                const Result& r = results[i];
+                out << "    {\"name\": \"" << r.name << "\", \"shape\": \"" << r.shape << "\", \"n\": " << r.n
+                    << ", \"ops\": " << r.ops << ", \"ns_per_op_best\": " << r.bestNs << ", \"ns_per_op_median\": " << r.medianNs
+                    << ", \"ops_per_s\": " << (r.medianNs > 0 ? 1e9 / r.medianNs : 0) << "}" << (i + 1 < results.size() ? ",\n" : "\n");
+            }
+            out << "  ]\n}\n";
+        }
+
+        void writeCsv(ostream& out) const {
+            out << "name,shape,n,ops,ns_per_op_best,ns_per_op_median,ops_per_s\n";
+            for (const Result& r : results) {
+                out << r.name << ',' << r.shape << ',' << r.n << ',' << r.ops << ',' << r.bestNs << ',' << r.medianNs << ','
+                    << (r.medianNs > 0 ? 1e9 / r.medianNs : 0) << '\n';
+            }
+        }
+};
+
+
+int main(int argc, char* argv[]) {
+    string format = "json", outFile, filter, dir = "bench_tmp";
+    double scale = 1;
+    int repeats = 5;
+    uint64_t seed = 42;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--format" && hasValue) format = argv[++i];
+        else if (arg == "--out" && hasValue) outFile = argv[++i];
+        else if (arg == "--scale" && hasValue) scale = atof(argv[++i]);
+        else if (arg == "--repeats" && hasValue) repeats = max(1, atoi(argv[++i]));
+        else if (arg == "--seed" && hasValue) seed = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--filter" && hasValue) filter = argv[++i];
+        else if (arg == "--dir" && hasValue) dir = argv[++i];
+        else {
+            cerr << "Usage: " << argv[0] << " [--format json|csv] [--out file] [--scale S] [--repeats R] [--seed N] [--filter text] [--dir tmpdir]\n";
+            return 2;
+        }
+    }
+    if (format != "json" && format != "csv") {
+        cerr << "Unknown format: " << format << '\n';
+        return 2;
+    }
+    ::mkdir(dir.c_str(), 0755); // Scratch space for the round trips
+
+    // Tree sizes at scale 1
+    const size_t WIDE = max<size_t>(1, 20000 * scale); // Entries in the wide directory
+    const size_t DEPTH = max<size_t>(1, 200 * scale); // Levels of the deep chain
+    const size_t FILES = max<size_t>(1, 500 * scale); // Files of the content-heavy tree
+    const size_t BYTES = 16 << 10, APPENDS = 32, PER_DIR = 50; // Their size, the writes they are built from, and grouping
+    const size_t MIXED_DEPTH = 4 + (scale >= 4), FANOUT = 6, MIXED_FILES = 20; // Random tree
+    const size_t EDITS = 20000; // Content edits timed per repeat
+
+    NullBuffer null;
+    streambuf* console = cout.rdbuf(&null); // From here on the commands print into nothing
+    ostream progress(cerr.rdbuf(&null)); // Warnings included
+
+    BenchmarkSuite suite(seed, repeats, filter, progress);
+    auto wide = [&](FileSystem& fs, TreeGenerator& gen) { gen.wide(fs, "w", WIDE); };
+    auto content = [&](FileSystem& fs, TreeGenerator& gen) { gen.content(fs, "c", FILES, BYTES, APPENDS, PER_DIR); };
+    auto mixed = [&](FileSystem& fs, TreeGenerator& gen) { gen.mixed(fs, "m", MIXED_DEPTH, FANOUT, MIXED_FILES); };
+    auto wideFile = [](size_t i) { return "w/" + TreeGenerator::fileName(i); };
+    auto contentFile = [&](size_t i) { return "c/" + TreeGenerator::dirName(i / PER_DIR) + "/" + TreeGenerator::fileName(i); };
+
+    // Random picks and payloads are drawn before timing starts, the same for every repeat
+    TreeGenerator picker(seed + 1);
+    vector<size_t> wideOrder(WIDE), contentOrder(EDITS), positions(EDITS);
+    for (size_t& i : wideOrder) i = picker.uniform(WIDE);
+    for (size_t& i : contentOrder) i = picker.uniform(FILES);
+    for (size_t& p : positions) p = picker.uniform(BYTES / 2);
+    vector<string> payloads(EDITS);
+    for (string& p : payloads) p = picker.text(64);
+
+    // Namespace operations
+    suite.run("create", "wide", WIDE, WIDE, [&](FileSystem& fs, TreeGenerator&) { fs.mkdir("w"); },
+              [&](FileSystem& fs, size_t i) { fs.createFile(wideFile(i)); });
+    suite.run("open_close", "wide", WIDE, WIDE, wide, [&](FileSystem& fs, size_t i) {
+        fs.openFile(wideFile(wideOrder[i]));
+        fs.closeFile(wideFile(wideOrder[i]));
+    });
+    suite.run("move", "wide", WIDE, WIDE, wide, [&](FileSystem& fs, size_t i) { fs.moveFile(wideFile(i), "w/r" + to_string(i)); });
+    suite.run("delete", "wide", WIDE, WIDE, wide, [&](FileSystem& fs, size_t i) { fs.deleteFile(wideFile(i)); });
+    suite.run("ls", "wide", WIDE, 10, [&](FileSystem& fs, TreeGenerator& gen) { wide(fs, gen); fs.chDir("w"); },
+              [&](FileSystem& fs, size_t) { fs.listFiles(); });
+    suite.run("mkdir", "deep", DEPTH, DEPTH, [](FileSystem&, TreeGenerator&) {}, [&](FileSystem& fs, size_t i) {
+        string path;
+        for (size_t level = 0; level <= i; level++) path += (level ? "/" : "") + TreeGenerator::dirName(level);
+        fs.mkdir(path); // Path building is part of the op, as it would be for a client
+    });
+    string deepest;
+    suite.run("chdir", "deep", DEPTH, 1000, [&](FileSystem& fs, TreeGenerator& gen) { deepest = "/" + gen.deep(fs, "p", DEPTH, 5); },
+              [&](FileSystem& fs, size_t) {
+                  fs.chDir(deepest);
+                  fs.chDir("/");
+              });
+
+    // Content operations on a content-heavy tree
+    suite.run("write", "content", FILES, EDITS, content, [&](FileSystem& fs, size_t i) { fs.writeFile(contentFile(contentOrder[i]), payloads[i]); });
+    suite.run("write_at", "content", FILES, EDITS, content,
+              [&](FileSystem& fs, size_t i) { fs.writeAt(contentFile(contentOrder[i]), positions[i], payloads[i]); });
+    suite.run("read", "content", FILES, EDITS / 10, content, [&](FileSystem& fs, size_t i) { fs.readFile(contentFile(contentOrder[i])); });
+    suite.run("read_from", "content", FILES, EDITS, content,
+              [&](FileSystem& fs, size_t i) { fs.readFrom(contentFile(contentOrder[i]), positions[i], 256); });
+    // The same through a descriptor (opened before timing): no path is resolved per call
+    suite.run("write_fd", "content", FILES, EDITS, [&](FileSystem& fs, TreeGenerator& gen) { content(fs, gen); fs.openFile(contentFile(FILES - 1), "a"); },
+              [&](FileSystem& fs, size_t i) { fs.writeFile("#1", payloads[i]); });
+    suite.run("read_fd", "content", FILES, EDITS, [&](FileSystem& fs, TreeGenerator& gen) { content(fs, gen); fs.openFile(contentFile(FILES - 1), "r"); },
+              [&](FileSystem& fs, size_t i) {
+                  fs.seek("#1", positions[i]);
+                  fs.readFile("#1", 256);
+              });
+    suite.run("seek", "content", FILES, EDITS, [&](FileSystem& fs, TreeGenerator& gen) { content(fs, gen); fs.openFile(contentFile(FILES - 1), "r"); },
+              [&](FileSystem& fs, size_t i) { fs.seek("#1", positions[i]); });
+    suite.run("handles", "content", FILES, 1000, [&](FileSystem& fs, TreeGenerator& gen) {
+        content(fs, gen);
+        for (size_t i = 0; i < 64; i++) fs.openFile(contentFile(i), "r");
+    }, [&](FileSystem& fs, size_t) { fs.listHandles(); });
+    // Reads of files spilled to the page store by a memory budget: random ones, and a sequential scan
+    // of one file that read-ahead should mostly serve from the page cache
+    auto spilled = [&](FileSystem& fs, TreeGenerator& gen) {
+        content(fs, gen);
+        fs.budget(1); // Spills every file
+    };
+    suite.run("budget", "content", FILES, 1, content, [&](FileSystem& fs, size_t) { fs.budget(FILES * BYTES / 2); }); // Spills about half
+    suite.run("read_from_spilled", "content", FILES, EDITS, spilled,
+              [&](FileSystem& fs, size_t i) { fs.readFrom(contentFile(contentOrder[i]), positions[i], 256); });
+    suite.run("read_from_spilled_seq", "content", FILES, EDITS, spilled,
+              [&](FileSystem& fs, size_t i) { fs.readFrom(contentFile(i * 256 / BYTES % FILES), i * 256 % BYTES, 256); });
+    suite.run("move_within", "content", FILES, EDITS, content,
+              [&](FileSystem& fs, size_t i) { fs.moveWithin(contentFile(contentOrder[i]), positions[i], 128, positions[EDITS - 1 - i]); });
+    suite.run("truncate", "content", FILES, EDITS, content,
+              [&](FileSystem& fs, size_t i) { fs.truncateFile(contentFile(contentOrder[i]), BYTES - 1 - i * (BYTES / 2) / EDITS); });
+    // Copies share contents with their source: a file, and the whole content tree
+    suite.run("cp", "content", FILES, FILES, content, [&](FileSystem& fs, size_t i) { fs.copyPath(contentFile(i), "c/copy" + to_string(i), false); });
+    suite.run("cp_r", "content", FILES, 3, content, [&](FileSystem& fs, size_t i) { fs.copyPath("c", "copy" + to_string(i), true); });
+
+    // Whole-tree operations
+    suite.run("memory_map", "mixed", 0, 5, mixed, [&](FileSystem& fs, size_t) { fs.showMemoryMap(); });
+    suite.run("stats", "mixed", 0, 100, mixed, [&](FileSystem& fs, size_t) { fs.printStats(cout); });
+    suite.run("grep", "content", FILES, 5, content, [&](FileSystem& fs, size_t) { fs.grep("/", "lambda sigma"); });
+    suite.run("find", "mixed", 0, 20, mixed, [&](FileSystem& fs, size_t) { fs.find("/", "f00001"); });
+    suite.run("du", "mixed", 0, 1000, mixed, [&](FileSystem& fs, size_t) { fs.diskUsage("m"); }); // One line per subdirectory, from the kept totals
+    suite.run("dedup", "content", FILES, 3, content, [&](FileSystem& fs, size_t) { fs.dedup(); });
+    // Compressing every file, and the first read of each compressed file, which decodes it
+    suite.run("compression", "content", FILES, 1, content, [&](FileSystem& fs, size_t) { fs.compression(0, 1); });
+    suite.run("read_compressed", "content", FILES, FILES, [&](FileSystem& fs, TreeGenerator& gen) {
+        content(fs, gen);
+        fs.compression(0, 1);
+    }, [&](FileSystem& fs, size_t i) { fs.readFrom(contentFile(i), 0, 256); });
+
+    // Round trips: the tree is built and saved in setup, the timed op loads (or saves) it
+    string text = dir + "/bench.dat", snapshot = dir + "/bench.fss";
+    suite.run("save_text", "content", FILES, 3, content, [&](FileSystem& fs, size_t) { fs.saveToFile(text); });
+    suite.run("load_text", "content", FILES, 3, [&](FileSystem& fs, TreeGenerator& gen) {
+        content(fs, gen);
+        fs.saveToFile(text);
+    }, [&](FileSystem& fs, size_t) { fs.loadFromFile(text); });
+    suite.run("save_snapshot", "content", FILES, 3, content, [&](FileSystem& fs, size_t) { fs.saveSnapshot(snapshot); });
+    suite.run("load_snapshot", "content", FILES, 3, [&](FileSystem& fs, TreeGenerator& gen) {
+        content(fs, gen);
+        fs.saveSnapshot(snapshot);
+    }, [&](FileSystem& fs, size_t) { fs.loadSnapshot(snapshot); });
+    // Startup on a tree of names: --scale 50 makes the wide directory 1M entries
+    suite.run("load_text", "wide", WIDE, 3, [&](FileSystem& fs, TreeGenerator& gen) {
+        wide(fs, gen);
+        fs.saveToFile(text);
+    }, [&](FileSystem& fs, size_t) { fs.loadFromFile(text); });
+    suite.run("save_snapshot", "wide", WIDE, 3, wide, [&](FileSystem& fs, size_t) { fs.saveSnapshot(snapshot); });
+    suite.run("load_snapshot", "wide", WIDE, 3, [&](FileSystem& fs, TreeGenerator& gen) {
+        wide(fs, gen);
+        fs.saveSnapshot(snapshot);
+    }, [&](FileSystem& fs, size_t) { fs.loadSnapshot(snapshot); });
+
+    // Host file transfers: one 8 MB file of text per op, copied in or written out
+    string host = dir + "/bench.host";
+    ofstream(host, ios::binary) << picker.text(8 << 20);
+    suite.run("import", "content", FILES, 5, content, [&](FileSystem& fs, size_t i) { fs.importFile(host, "c/imported" + to_string(i)); });
+    suite.run("export", "content", FILES, 5, [&](FileSystem& fs, TreeGenerator& gen) {
+        content(fs, gen);
+        fs.importFile(host, "c/imported");
+    }, [&](FileSystem& fs, size_t) { fs.exportFile("c/imported", host + ".out"); });
+
+    // The same round trips at fixed thread counts (the runs above use one thread per core)
+    for (size_t threads : {1, 2, 4, 8}) {
+        string t = "_t" + to_string(threads);
+        auto saved = [&](bool asText) {
+            return [&, threads, asText](FileSystem& fs, TreeGenerator& gen) {
+                content(fs, gen);
+                fs.setThreads(threads);
+                if (asText) fs.saveToFile(text);
+                else fs.saveSnapshot(snapshot);
+            };
+        };
+        suite.run("save_text" + t, "content", FILES, 3, saved(false), [&](FileSystem& fs, size_t) { fs.saveToFile(text); });
+        suite.run("load_text" + t, "content", FILES, 3, saved(true), [&](FileSystem& fs, size_t) { fs.loadFromFile(text); });
+        suite.run("save_snapshot" + t, "content", FILES, 3, saved(false), [&](FileSystem& fs, size_t) { fs.saveSnapshot(snapshot); });
+        suite.run("load_snapshot" + t, "content", FILES, 3, saved(false), [&](FileSystem& fs, size_t) { fs.loadSnapshot(snapshot); });
+    }
+
+    // Journaled writes: the same edits with the write-ahead journal on
+    suite.run("journal_write", "content", FILES, EDITS, [&](FileSystem& fs, TreeGenerator& gen) {
+        removeScratch(dir);
+        fs.openStorage(snapshot, dir + "/missing.dat");
+        content(fs, gen);
+    }, [&](FileSystem& fs, size_t i) {
+        fs.writeFile(contentFile(contentOrder[i]), payloads[i]);
+        fs.endCommand(); // Checkpoints run between commands
+    });
+
+    cout.rdbuf(console);
+    cerr.rdbuf(progress.rdbuf());
+    removeScratch(dir);
+
+    ofstream file;
+    if (!outFile.empty()) {
+        file.open(outFile);
+        if (!file) {
+            cerr << "Cannot write " << outFile << '\n';
+            return 1;
+        }
+    }
+    ostream& out = outFile.empty() ? cout : file;
+    if (format == "json") suite.writeJson(out, scale);
+    else suite.writeCsv(out);
+    return 0;
+}
@@ -0,0 +1,226 @@
+// Load generator for server mode: command throughput and latency as the number of clients grows.
+//
+//   g++ -std=c++17 -O2 -pthread benchmarks/loadgen.cpp -o fs_loadgen
+//   ./fs_loadgen [--socket path] [--workers N] [--clients 1,2,4,...] [--seconds S] [--mix read|write|mixed]
+//                [--files F] [--bytes B] [--seed N] [--format table|csv|json]
+//
+// Without --socket it serves a fresh FileSystem in-process on a scratch socket with --workers threads;
+// with it, it drives a server already running there (fs --server path). Either way it first lays out
+// one directory per client, /loadgen/c<k>, of F files of B bytes, through the protocol like any client.
+//
+// Each client is a thread with its own connection, sending one command at a time for S seconds:
+//   read   read_from at random offsets of any client's files (the directory shared, the file shared)
+//   write  write_at at random offsets of its own files (the directory shared, the file exclusive)
+//   mixed  70% read, 25% write, 5% create + delete in its own directory (that directory exclusive)
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include "TreeGenerator.h"
+#include "../Server.h"
+
+using namespace std;
+
+
+struct Run {
+    size_t clients = 0;
+    uint64_t ops = 0, errors = 0;
+    double seconds = 0;
+    LatencyHistogram latency; // Per command, ns
+};
+
+class LoadGenerator {
+    private:
+        string socketPath, mix;
+        size_t files, bytes;
+        uint64_t seed;
+
+        string fileOf(size_t client, size_t i) const { return "/loadgen/c" + to_string(client) + "/" + TreeGenerator::fileName(i); }
+
+        // One client's commands until the deadline; false if the connection failed
+        bool drive(size_t client, size_t clients, chrono::steady_clock::time_point deadline, Run& run, mutex& merge) {
+            Client connection;
+            if (!connection.connect(socketPath)) return false;
+            mt19937_64 rng(seed * 1000003 + client);
+            TreeGenerator gen(seed + client);
+            string payload = gen.text(64), output;
+            vector<uint64_t> latencies;
+            uint64_t errors = 0;
+            size_t created = 0;
+            while (chrono::steady_clock::now() < deadline) {
+                size_t roll = rng() % 100;
+                bool read = mix == "read" || (mix == "mixed" && roll < 70);
+                bool tree = mix == "mixed" && roll >= 95;
+                vector<string> lines;
+                if (read) {
+                    lines.push_back("read_from " + fileOf(rng() % clients, rng() % files) + " " + to_string(rng() % (bytes - 64)) + " 64");
+                } else if (tree) {
+                    string scratch = "/loadgen/c" + to_string(client) + "/tmp" + to_string(created++);
+                    lines.push_back("create " + scratch);
+                    lines.push_back("delete " + scratch);
+                } else {
+                    lines.push_back("write_at " + fileOf(client, rng() % files) + " " + to_string(rng() % (bytes - 64)) + " " + payload);
+                }
+                for (const string& line : lines) {
+                    bool ok;
+                    auto started = chrono::steady_clock::now();
+                    if (!connection.call(line, output, ok)) return false;
+                    latencies.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started).count());
+                    errors += !ok;
+                }
+            }
+            lock_guard<mutex> guard(merge);
+            for (uint64_t ns : latencies) run.latency.record(ns);
+            run.ops += latencies.size();
+            run.errors += errors;
+            return true;
+        }
+
+    public:
+        LoadGenerator(string socketPath, string mix, size_t files, size_t bytes, uint64_t seed)
+            : socketPath(move(socketPath)), mix(move(mix)), files(files), bytes(bytes), seed(seed) {}
+
+        // Lay out the directories of up to `clients` clients, replacing what an earlier run left
+        bool setup(size_t clients) {
+            Client connection;
+            if (!connection.connect(socketPath)) return false;
+            TreeGenerator gen(seed);
+            string output;
+            bool ok;
+            auto call = [&](const string& line) { return connection.call(line, output, ok); };
+            if (!call("mkdir /loadgen")) return false; // Fails harmlessly if it is there already
+            for (size_t c = 0; c < clients; c++) {
+                if (!call("mkdir /loadgen/c" + to_string(c))) return false;
+                for (size_t i = 0; i < files; i++) {
+                    string file = fileOf(c, i);
+                    if (!call("delete " + file) || !call("create " + file) || !call("write " + file + " " + gen.text(bytes))) return false;
+                    if (!ok) {
+                        cerr << "Cannot write " << file << ": " << output;
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+
+        bool measure(size_t clients, double seconds, Run& run) {
+            run.clients = clients; // A fresh run: the histogram can't be copied or reset
+            run.seconds = seconds;
+            mutex merge;
+            atomic<bool> failed{false};
+            auto deadline = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(seconds));
+            vector<thread> threads;
+            for (size_t c = 0; c < clients; c++) {
+                threads.emplace_back([&, c] {
+                    if (!drive(c, clients, deadline, run, merge)) failed = true;
+                });
+            }
+            for (thread& t : threads) t.join();
+            return !failed;
+        }
+};
+
+
+int main(int argc, char* argv[]) {
+    string socketPath, mix = "mixed", format = "table";
+    size_t workers = max(1u, thread::hardware_concurrency());
+    vector<size_t> clientCounts = {1, 2, 4, 8, 16};
+    double seconds = 2;
+    size_t files = 32, bytes = 4096;
+    uint64_t seed = 42;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--socket" && hasValue) socketPath = argv[++i];
+        else if (arg == "--workers" && hasValue) workers = max(1, atoi(argv[++i]));
+        else if (arg == "--seconds" && hasValue) seconds = max(0.1, atof(argv[++i]));
+        else if (arg == "--mix" && hasValue) mix = argv[++i];
+        else if (arg == "--files" && hasValue) files = max(1, atoi(argv[++i]));
+        else if (arg == "--bytes" && hasValue) bytes = max(128, atoi(argv[++i]));
+        else if (arg == "--seed" && hasValue) seed = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--format" && hasValue) format = argv[++i];
+        else if (arg == "--clients" && hasValue) {
+            clientCounts.clear();
+            stringstream list(argv[++i]);
+            string count;
+            while (getline(list, count, ',')) {
+                if (atoi(count.c_str()) > 0) clientCounts.push_back(atoi(count.c_str()));
+            }
+        } else {
+            cerr << "Usage: " << argv[0] << " [--socket path] [--workers N] [--clients 1,2,4,...] [--seconds S] [--mix read|write|mixed]"
+                 << " [--files F] [--bytes B] [--seed N] [--format table|csv|json]\n";
+            return 2;
+        }
+    }
+    if ((mix != "read" && mix != "write" && mix != "mixed") || (format != "table" && format != "csv" && format != "json") || clientCounts.empty()) {
+        cerr << "Unknown --mix or --format, or no --clients\n";
+        return 2;
+    }
+
+    // In-process server on a scratch socket, its command output discarded
+    unique_ptr<FileSystem> fs;
+    unique_ptr<Server> server;
+    thread serving;
+    if (socketPath.empty()) {
+        socketPath = "/tmp/fs_loadgen." + to_string(getpid()) + ".sock";
+        fs = make_unique<FileSystem>();
+        server = make_unique<Server>(*fs, socketPath, workers);
+        if (!server->start()) return 1;
+        serving = thread([&] { server->run(); });
+    }
+
+    LoadGenerator load(socketPath, mix, files, bytes, seed);
+    deque<Run> runs; // Never moved: histograms are atomic
+    bool ok = load.setup(*max_element(clientCounts.begin(), clientCounts.end()));
+    for (size_t i = 0; ok && i < clientCounts.size(); i++) {
+        cerr << clientCounts[i] << " clients..." << flush;
+        runs.emplace_back();
+        ok = load.measure(clientCounts[i], seconds, runs.back());
+        cerr << ' ' << uint64_t(runs.back().ops / seconds) << " ops/s\n";
+    }
+    if (!ok) cerr << "Lost the connection to " << socketPath << '\n';
+    if (server) {
+        server->stop();
+        serving.join();
+    }
+    if (!ok) return 1;
+
+    double base = runs.front().ops / runs.front().seconds; // Throughput of the first run, which the others are compared to
+    if (format == "table") {
+        cout << "mix " << mix << ", " << (fs ? to_string(workers) + " workers in-process" : "server at " + socketPath) << ", "
+             << seconds << " s per run\n";
+        cout << setw(8) << "clients" << setw(12) << "ops/s" << setw(10) << "scaling" << setw(12) << "p50 us" << setw(12) << "p99 us"
+             << setw(10) << "errors" << '\n';
+    } else if (format == "csv") {
+        cout << "mix,clients,ops,seconds,ops_per_s,scaling,p50_us,p99_us,errors\n";
+    } else {
+        cout << "{\n  \"mix\": \"" << mix << "\",\n  \"workers\": " << (fs ? to_string(workers) : "null") << ",\n  \"runs\": [\n";
+    }
+    cout << fixed << setprecision(1);
+    for (size_t i = 0; i < runs.size(); i++) {
+        const Run& r = runs[i];
+        double rate = r.ops / r.seconds, scaling = base > 0 ? rate / base : 0;
+        double p50 = r.latency.percentile(0.5) / 1000.0, p99 = r.latency.percentile(0.99) / 1000.0;
+        if (format == "table") {
+            cout << setw(8) << r.clients << setw(12) << rate << setw(9) << scaling << 'x' << setw(12) << p50 << setw(12) << p99
+                 << setw(10) << r.errors << '\n';
+        } else if (format == "csv") {
+            cout << mix << ',' << r.clients << ',' << r.ops << ',' << r.seconds << ',' << rate << ',' << scaling << ',' << p50 << ','
+                 << p99 << ',' << r.errors << '\n';
+        } else {
+            cout << "    {\"clients\": " << r.clients << ", \"ops\": " << r.ops << ", \"seconds\": " << r.seconds << ", \"ops_per_s\": "
+                 << rate << ", \"scaling\": " << scaling << ", \"p50_us\": " << p50 << ", \"p99_us\": " << p99 << ", \"errors\": "
+                 << r.errors << "}" << (i + 1 < runs.size() ? ",\n" : "\n");
+        }
+    }
+    if (format == "json") cout << "  ]\n}\n";
+    return 0;
+}
@@ -1,114 +1,148 @@
 #include "FileSystem.h"
 #include "CommandUtils.h"
+#include "Server.h"
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <sstream>
 
 using namespace std;
 
 
-int main() {
+// Overwrite file with the current stats
+void dumpStats(FileSystem& fs, const string& file) {
+    ofstream out(file, ios::trunc);
+    if (out) fs.printStats(out);
+    else cerr << "Cannot write stats to " << file << '\n';
+}
+
+
+int main(int argc, char* argv[]) {
+    bool batch = false;     // Run a script without prompts or menu
+    bool failFast = false;  // Stop at the first failing command with a nonzero exit code
+    string script = "-";    // Batch input, "-" for stdin
+    int threads = 0;        // Search workers, 0 for one per core
+    string statsFile;       // Where to dump the stats periodically ("" for never)
+    double statsInterval = 10;  // Seconds between dumps
+    long compressIdle = 0, compressSize = 0;  // Compression policy (see FileSystem::setCompression), off by default
+    bool lazy = false;      // Load directories and contents from the snapshot as they are used
+    long memoryBudget = 0;  // Bytes of file contents kept in memory (see FileSystem::setMemoryBudget), 0 for no limit
+    string serverSocket;    // Serve clients on this Unix-domain socket instead of reading commands ("" for no server)
+    size_t workers = max(1u, thread::hardware_concurrency());  // Server threads running client commands
+    string connectSocket;   // Send the commands to the server on this socket instead of running them
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--batch") {
+            batch = true;
+            if (i + 1 < argc && (argv[i + 1][0] != '-' || string(argv[i + 1]) == "-")) script = argv[++i];
+        } else if (arg == "--fail-fast") {
+            failFast = true;
+        } else if (arg == "--threads" && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            threads = atoi(argv[++i]);
+        } else if (arg == "--stats-dump" && i + 1 < argc) {
+            statsFile = argv[++i];
+        } else if (arg == "--stats-interval" && i + 1 < argc && atof(argv[i + 1]) > 0) {
+            statsInterval = atof(argv[++i]);
+        } else if (arg == "--lazy") {
+            lazy = true;
+        } else if (arg == "--compress-idle" && i + 1 < argc && atol(argv[i + 1]) >= 0) {
+            compressIdle = atol(argv[++i]);
+        } else if (arg == "--compress-size" && i + 1 < argc && atol(argv[i + 1]) >= 0) {
+            compressSize = atol(argv[++i]);
+        } else if (arg == "--memory-budget" && i + 1 < argc && atol(argv[i + 1]) >= 0) {
+            memoryBudget = atol(argv[++i]);
+        } else if (arg == "--server" && i + 1 < argc) {
+            serverSocket = argv[++i];
+        } else if (arg == "--workers" && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            workers = atoi(argv[++i]);
+        } else if (arg == "--connect" && i + 1 < argc) {
+            connectSocket = argv[++i];
+        } else {
+            cerr << "Usage: " << argv[0] << " [--batch [script|-]] [--fail-fast] [--threads N] [--lazy] [--stats-dump file [--stats-interval seconds]]"
+                 << " [--compress-idle commands] [--compress-size bytes] [--memory-budget bytes] [--server socket [--workers N]]"
+                 << " [--connect socket]\n";
+            return 2;
+        }
+    }
+
+    ifstream scriptFile;
+    if (batch) {
+        ios::sync_with_stdio(false);  // Let cout buffer on its own instead of going through stdio
+        static char outputBuffer[1 << 20];
+        cout.rdbuf()->pubsetbuf(outputBuffer, sizeof(outputBuffer));  // One large buffer, flushed when full
+        if (script != "-") {
+            scriptFile.open(script);
+            if (!scriptFile) {
+                cerr << "Cannot open script: " << script << '\n';
+                return 2;
+            }
+        }
+    }
+    istream& input = scriptFile.is_open() ? scriptFile : cin;
+    if (!connectSocket.empty()) return runClient(connectSocket, input, failFast);  // The server has the file system
+
     FileSystem fs;  // Create a FileSystem object
-    fs.loadFromFile("sample.dat");  // Load file system data from "sample.dat"
-    menu();  // Display menu of available commands
+    if (threads > 0) fs.setThreads(threads);
+    fs.setCompression(compressIdle, compressSize);  // Applied to the loaded tree by openStorage
+    fs.setLazyLoad(lazy);
+    fs.setMemoryBudget(memoryBudget);  // Applied to the loaded tree by openStorage too
+    fs.openStorage("sample.fss", "sample.dat");  // Load the snapshot (or "sample.dat" on first run) and replay the journal
 
+    int status = 0;
+    if (!serverSocket.empty()) {
+        Server server(fs, serverSocket, workers);
+        if (!statsFile.empty()) {
+            server.every(statsInterval, [&] {
+                auto lock = fs.lockTree(true);  // Like the stats command, which walks every file
+                dumpStats(fs, statsFile);
+            });
+        }
+        if (server.start()) server.run();  // Until SIGINT or SIGTERM
+        else status = 2;
+        fs.closeStorage();
+        if (!statsFile.empty()) dumpStats(fs, statsFile);
+        cout << "File system saved. Exiting...\n";
+        return status;
+    }
+    if (!batch) menu();  // Display menu of available commands
+
+    size_t commands = 0, lineNumber = 0;
+    auto started = chrono::steady_clock::now();
+    auto nextDump = started + chrono::duration<double>(statsInterval);
+    string line;
     while (true) {  // Main command loop
-        fs.displayPath();            // Shows path like: main>submain>
-        string cmd;
-        cin >> cmd;  // Read user command
+        if (!batch) fs.displayPath();  // Shows path like: main>submain>
+        if (!getline(input, line)) break;  // End of input ends the session like exit
+        lineNumber++;
+        if (batch && (line.empty() || line[0] == '#')) continue;  // Blank lines and comments in scripts
 
-        // Command processing block
-        if (cmd == "create") {
-            string fname;
-            cin >> fname;
-            fs.createFile(fname);  // Create new file
-        } else if (cmd == "delete") {
-            string fname;
-            cin >> fname;
-            fs.deleteFile(fname);  // Delete specified file
-        } else if (cmd == "help") {
-            string specificCmd;
-            getline(cin, specificCmd);  // Read the rest of the line after "help"
-        
-            // Trim leading spaces (if any)
-            if (!specificCmd.empty() && specificCmd[0] == ' ') {
-                specificCmd = specificCmd.substr(1);
-            }
-        
-            if (specificCmd.empty()) {
-                fs.showHelp();  // Show general help if no specific command is provided
-            } else {
-                fs.showSpecificHelp(specificCmd);  // Show help for the specific command
-            }
-        } else if (cmd == "mkdir") {
-            string dname;
-            cin >> dname;  
-            fs.mkdir(dname);  // Create new directory
-        } else if (cmd == "chdir") {
-            string dname;
-            cin >> dname;  
-            fs.chDir(dname);  // Change current directory
-        } else if (cmd == "ls") {
-            fs.listFiles();  // Lists all files and directories in the current directory
-        } else if (cmd == "move") {
-            string src, tgt;
-            cin >> src >> tgt;  // Read source and target paths
-            fs.moveFile(src, tgt);  // Move file from source to target
-        } else if (cmd == "open") {
-            string fname;
-            cin >> fname;           
-            fs.openFile(fname);  // Open specified file
-        } else if (cmd == "close") {
-            string fname;
-            cin >> fname;            
-            fs.closeFile(fname);  // Close specified file
-        } else if (cmd == "write") {
-            string fname, text;
-            cin >> fname;  
-            getline(cin, text);  // Read text to write (allows spaces)
-            if (text[0] == ' ') text = text.substr(1);  // Remove leading space if present
-            File* file = fs.openFile(fname);  // Get file pointer
-            if (file) file->write_to_file(text);  // Write text if file exists
-        } else if (cmd == "write_at") {
-            string fname;
-            int pos;
-            string text;
-            cin >> fname >> pos;  // Read filename and position
-            getline(cin, text);  // Read text to write
-            if (text[0] == ' ') text = text.substr(1);
-            File* file = fs.openFile(fname);  // Get file pointer
-            if (file) file->write_at(pos, text);  // Write at position if file exists
-        } else if (cmd == "read") {
-            string fname;
-            cin >> fname;  // Read filename
-            File* file = fs.openFile(fname);  // Get file pointer
-            if (file) cout << file->read_from_file() << endl;  // Output file contents
-        } else if (cmd == "read_from") {
-            string fname;
-            int start, size;
-            cin >> fname >> start >> size;  // Read filename, start position, and size
-            File* file = fs.openFile(fname);  // Get file pointer
-            if (file) cout << file->read_from(start, size) << endl;  // Output portion of file
-        } else if (cmd == "move_within") {
-            string fname;
-            int start, size, target;
-            cin >> fname >> start >> size >> target;  // Read filename and positions
-            File* file = fs.openFile(fname);  // Get file pointer
-            if (file) file->move_within_file(start, size, target);  // Move data within file
-        } else if (cmd == "truncate") {
-            string fname;
-            int size;
-            cin >> fname >> size;  // Read filename and new size
-            File* file = fs.openFile(fname);  // Get file pointer
-            if (file) file->truncate_file(size);  // Truncate file to specified size
-        } else if (cmd == "memory_map") {
-            fs.showMemoryMap();  // Display memory map of file system
-        } else if (cmd == "exit") {
-            fs.saveToFile("sample.dat");  // Save file system state
-            cout << "File system saved. Exiting...\n";
-            break;  // Exit command loop
-        } else {
-            suggestCommand(cmd);  // Handle invalid commands by suggesting similar commands
+        fs.resetStatus();
+        bool keepGoing = runCommand(fs, line);
+        fs.endCommand();  // Compresses what went cold
+        commands++;
+        if (failFast && fs.commandFailed()) {
+            cout.flush();
+            cerr << "Stopped at line " << lineNumber << ": " << line << '\n';
+            status = 1;
+            break;
+        }
+        if (!statsFile.empty() && chrono::steady_clock::now() >= nextDump) {  // Checked between commands, so no locking
+            dumpStats(fs, statsFile);
+            nextDump = chrono::steady_clock::now() + chrono::duration<double>(statsInterval);
         }
+        if (!keepGoing) break;
     }
 
-    return 0;  // End of program
+    fs.closeStorage();  // Flush the journal (state is already saved incrementally)
+    if (!statsFile.empty()) dumpStats(fs, statsFile);
+    cout << "File system saved. Exiting...\n";
+    cout.flush();
+
+    if (batch) {
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        cerr << "Ran " << commands << " commands in " << seconds * 1000 << " ms ("
+             << (seconds > 0 ? commands / seconds : 0) << " commands/s)\n";
+    }
+    return status;  // End of program
 }
\ No newline at end of file